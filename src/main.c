@@ -7,33 +7,708 @@
  ****************************************************************************
  */
 
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <locale.h>
+#include <wchar.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <ncurses.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/* ---------------------------- Journal Stuff ------------------------- */
+
+#define JOURNAL_MAGIC "PSJ1"
+#define JOURNAL_BUFSIZE 512
+#define JOURNAL_IDLEMS 500
+#define JOURNAL_MAXOPS 256
+#define JOURNAL_MAXAGEMS 2000
+
+#define JOURNAL_INS 'i'
+#define JOURNAL_DEL 'd'
+
+typedef struct journal {
+    int fd;
+    int hold;
+    bool unsynced;
+    long ops;
+    uint64_t since;
+    size_t len;
+    unsigned char buf[JOURNAL_BUFSIZE];
+} journal_t;
+
+// Swap files are committed to disk by a thread of their own, so no key
+// waits on it. It syncs a duplicate of the descriptor, which stays valid
+// when the journal is closed meanwhile.
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journal_cond = PTHREAD_COND_INITIALIZER;
+static bool journal_started = false;
+static int journal_pending = -1;
+
+/* Initialise the journal structure (no swap file attached).
+ */
+void journal_init(journal_t *j)
+{
+    j->fd = -1;
+    j->hold = 0;
+    j->unsynced = false;
+    j->ops = 0;
+    j->since = 0;
+    j->len = 0;
+}
+/* Get monotonic clock in milliseconds.
+ */
+static uint64_t journal_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000u + ts.tv_nsec / 1000000;
+}
+/* Get modification time of a file in nanoseconds, the journal is only
+ * valid against that exact version.
+ */
+static long unsigned journal_mtime(const struct stat *st)
+{
+    return (long unsigned)st->st_mtim.tv_sec * 1000000000u
+        + st->st_mtim.tv_nsec;
+}
+/* Get swap file name of given file.
+ */
+static void journal_name(char *name, size_t size, const char *filename)
+{
+    snprintf(name, size, "%s.swp", filename);
+}
+/* Encode a number as variable length bytes, return bytes used.
+ */
+static size_t journal_putnum(unsigned char *p, long unsigned n)
+{
+    size_t i = 0;
+
+    while(n >= 0x80) {
+        p[i++] = (n & 0x7F) | 0x80;
+        n >>= 7;
+    }
+    p[i++] = n;
+    return i;
+}
+/* Decode a variable length number, return bytes used (0 if truncated).
+ */
+static size_t journal_getnum(const unsigned char *p, size_t size,
+    long unsigned *n)
+{
+    size_t i;
+    int shift = 0;
+
+    *n = 0;
+    for(i = 0; i < size && shift < 64; i++, shift += 7) {
+        *n |= (long unsigned)(p[i] & 0x7F) << shift;
+        if(!(p[i] & 0x80))
+            return i + 1;
+    }
+    return 0;
+}
+/* Write pending records to the swap file (no sync). Records have no
+ * framing, so when a write fails the torn record is cut off again and
+ * journaling stops there, recovery then gets every record before it.
+ */
+void journal_flush(journal_t *j)
+{
+    sigset_t set, old;
+    size_t done = 0;
+    ssize_t n;
+    off_t end;
+
+    if(j->fd < 0 || j->len == 0) return;
+
+    // Hangup flushes as well, it must not find records half written.
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+    while(done < j->len) {
+        n = write(j->fd, j->buf + done, j->len - done);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0) {
+            if((end = lseek(j->fd, 0, SEEK_END)) >= (off_t)done
+                    && ftruncate(j->fd, end - done) == 0)
+                fsync(j->fd);
+            close(j->fd);
+            j->fd = -1;
+            break;
+        }
+        done += n;
+    }
+    j->len = 0;
+    j->unsynced = j->fd >= 0;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+/* Write pending records and commit them to disk, waiting for it.
+ */
+void journal_sync(journal_t *j)
+{
+    journal_flush(j);
+    if(j->fd >= 0 && j->unsynced) {
+        fsync(j->fd);
+        j->unsynced = false;
+    }
+    j->ops = 0;
+}
+/* Sync thread, commits each swap file handed to it.
+ */
+static void *journal_syncer(void *arg)
+{
+    int fd;
+
+    (void)arg;
+    pthread_mutex_lock(&journal_lock);
+    for(;;) {
+        while(journal_pending < 0)
+            pthread_cond_wait(&journal_cond, &journal_lock);
+        fd = journal_pending;
+        journal_pending = -1;
+        pthread_mutex_unlock(&journal_lock);
+        fdatasync(fd);
+        close(fd);
+        pthread_mutex_lock(&journal_lock);
+    }
+    return NULL;
+}
+/* Write pending records and have the sync thread commit them to disk,
+ * without waiting for it. Syncs in place if there is no thread.
+ */
+void journal_commit(journal_t *j)
+{
+    sigset_t set, old;
+    pthread_t thread;
+
+    journal_flush(j);
+    j->ops = 0;
+    if(j->fd < 0 || !j->unsynced) return;
+
+    pthread_mutex_lock(&journal_lock);
+    if(!journal_started) {
+        // Signals are handled on the main thread only.
+        sigfillset(&set);
+        pthread_sigmask(SIG_BLOCK, &set, &old);
+        if(pthread_create(&thread, NULL, journal_syncer, NULL) == 0) {
+            pthread_detach(thread);
+            journal_started = true;
+        }
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+    }
+    if(!journal_started) {
+        pthread_mutex_unlock(&journal_lock);
+        journal_sync(j);
+        return;
+    }
+
+    // Still busy with an earlier one, try again next time.
+    if(journal_pending < 0 && (journal_pending = dup(j->fd)) >= 0) {
+        j->unsynced = false;
+        pthread_cond_signal(&journal_cond);
+    }
+    pthread_mutex_unlock(&journal_lock);
+}
+/* Append an edit operation to the journal buffer.
+ */
+void journal_record(journal_t *j, int op, long unsigned at, long unsigned arg)
+{
+    unsigned char *p;
+
+    if(j->fd < 0 || j->hold > 0) return;
+
+    // Room for op byte and two numbers at most.
+    if(j->len + 1 + 2 * 10 > JOURNAL_BUFSIZE)
+        journal_flush(j);
+
+    p = j->buf + j->len;
+    *p++ = op;
+    p += journal_putnum(p, at);
+    if(op == JOURNAL_INS)
+        *p++ = arg;
+    else
+        p += journal_putnum(p, arg);
+    j->len = p - j->buf;
+
+    // Steady typing never goes idle, so commit every so many edits or so
+    // often anyway.
+    if(j->ops++ == 0)
+        j->since = journal_clock();
+    else if(j->ops >= JOURNAL_MAXOPS
+            || journal_clock() - j->since >= JOURNAL_MAXAGEMS)
+        journal_commit(j);
+}
+/* Attach swap file for given file, starting fresh or appending to it.
+ */
+int journal_open(journal_t *j, const char *filename, bool append)
+{
+    unsigned char head[32];
+    char name[512];
+    struct stat st;
+    size_t len;
+
+    journal_name(name, sizeof(name), filename);
+    if(append) {
+        if((j->fd = open(name, O_WRONLY | O_APPEND)) < 0)
+            return 1;
+        return 0;
+    }
+
+    // Journal is only valid against this version of the file.
+    if(stat(filename, &st) != 0)
+        memset(&st, 0, sizeof(st));
+    if((j->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0)
+        return 1;
+    memcpy(head, JOURNAL_MAGIC, 4);
+    len = 4;
+    len += journal_putnum(head + len, st.st_size);
+    len += journal_putnum(head + len, journal_mtime(&st));
+    if(write(j->fd, head, len) != (ssize_t)len) {
+        close(j->fd);
+        j->fd = -1;
+        return 2;
+    }
+    fsync(j->fd);
+    j->len = 0;
+    j->unsynced = false;
+    return 0;
+}
+/* Detach swap file, removing it when edits need no recovery.
+ */
+void journal_close(journal_t *j, const char *filename, bool remove)
+{
+    char name[512];
+
+    if(j->fd < 0) return;
+    if(remove) {
+        close(j->fd);
+        journal_name(name, sizeof(name), filename);
+        unlink(name);
+    }
+    else {
+        journal_sync(j);
+        close(j->fd);
+    }
+    j->fd = -1;
+    j->len = 0;
+}
+
+/* ---------------------------- Syntax Stuff ------------------------- */
+
+#define HL_NORMAL 0
+#define HL_COMMENT 1
+#define HL_KEYWORD 2
+#define HL_TYPE 3
+#define HL_STRING 4
+#define HL_NUMBER 5
+
+#define HL_NUMBERS 0x01
+#define HL_MLSTRINGS 0x02
+
+#define HL_STATE_NORMAL 0
+#define HL_STATE_COMMENT 1
+#define HL_STATE_STRING 2
+#define HL_STATE_UNKNOWN 0xFF
+
+#define HL_SYNC 200
+#define HL_MAXRELEX 1000
+
+typedef struct syntax {
+    const char *name;
+    const char **exts;
+    const char **keywords;
+    const char **types;
+    const char *comment;
+    const char *mlstart;
+    const char *mlend;
+    const char *quotes;
+    const char *numchars;
+    int flags;
+} syntax_t;
+
+static const char *c_exts[] = { ".c", ".h", ".cc", ".cpp", ".hpp", ".cxx",
+    NULL };
+static const char *c_keywords[] = { "auto", "break", "case", "const",
+    "continue", "default", "do", "else", "enum", "extern", "for", "goto",
+    "if", "inline", "register", "restrict", "return", "sizeof", "static",
+    "struct", "switch", "typedef", "union", "volatile", "while", "#include",
+    "#define", "#undef", "#if", "#ifdef", "#ifndef", "#elif", "#else",
+    "#endif", "#pragma", "#error", NULL };
+static const char *c_types[] = { "char", "double", "float", "int", "long",
+    "short", "signed", "unsigned", "void", "bool", "size_t", "ssize_t",
+    "FILE", "int8_t", "int16_t", "int32_t", "int64_t", "uint8_t",
+    "uint16_t", "uint32_t", "uint64_t", "NULL", "true", "false", NULL };
+static const char *sh_exts[] = { ".sh", ".bash", ".bashrc", ".profile",
+    NULL };
+static const char *sh_keywords[] = { "if", "then", "else", "elif", "fi",
+    "for", "while", "until", "do", "done", "case", "esac", "in", "function",
+    "select", "time", "return", "local", "export", "readonly", "shift",
+    "exit", "break", "continue", NULL };
+static const char *sh_types[] = { "echo", "printf", "read", "cd", "test",
+    "set", "unset", "source", "eval", "exec", "trap", "wait", "kill",
+    "true", "false", NULL };
+static const char *log_exts[] = { ".log", NULL };
+static const char *log_keywords[] = { "ERROR", "Error", "error", "FATAL",
+    "Fatal", "fatal", "CRITICAL", "CRIT", "EMERG", "ALERT", "PANIC",
+    "FAIL", "FAILED", "failed", NULL };
+static const char *log_types[] = { "WARN", "WARNING", "Warning", "warning",
+    "NOTICE", "INFO", "Info", "DEBUG", "Debug", "TRACE", NULL };
+
+static const syntax_t syntaxes[] = {
+    { "C", c_exts, c_keywords, c_types, "//", "/*", "*/", "\"'", ".",
+        HL_NUMBERS },
+    { "Shell", sh_exts, sh_keywords, sh_types, "#", NULL, NULL, "\"'`", ".",
+        HL_NUMBERS | HL_MLSTRINGS },
+    { "Log", log_exts, log_keywords, log_types, NULL, NULL, NULL, "\"",
+        ".:-", HL_NUMBERS },
+};
+
+/* Find syntax to highlight given file with (NULL if none).
+ */
+const syntax_t *syntax_find(const char *filename)
+{
+    size_t i, len = strlen(filename);
+    const char **ext;
+
+    for(i = 0; i < sizeof(syntaxes) / sizeof(syntaxes[0]); i++) {
+        for(ext = syntaxes[i].exts; *ext != NULL; ext++) {
+            size_t n = strlen(*ext);
+            if(len >= n && !strcmp(filename + len - n, *ext))
+                return &syntaxes[i];
+        }
+    }
+    return NULL;
+}
+/* Check if word is in given list.
+ */
+static bool syntax_isword(const char **words, const char *p, size_t len)
+{
+    for(; *words != NULL; words++) {
+        if(!strncmp(*words, p, len) && (*words)[len] == '\0')
+            return true;
+    }
+    return false;
+}
+/* Check if string starts at given position of a line.
+ */
+static size_t syntax_match(const char *s, const char *p, long unsigned len)
+{
+    size_t n;
+
+    if(s == NULL) return 0;
+    n = strlen(s);
+    return n <= len && !strncmp(s, p, n) ? n : 0;
+}
+/* Lex a line starting in given state, up to byte upto. Classes of bytes
+ * from byte from on are stored in hl (may be NULL), returns the state
+ * lexing stopped in.
+ */
+int syntax_lex(const syntax_t *syn, const char *p, long unsigned len,
+    int state, unsigned char *hl, long unsigned from, long unsigned upto)
+{
+    long unsigned i = 0, j;
+    int cls;
+    size_t n;
+
+    if(upto > len) upto = len;
+    while(i < upto) {
+        char c = p[i];
+
+        j = i + 1;
+        if(state == HL_STATE_COMMENT) {
+            cls = HL_COMMENT;
+            if((n = syntax_match(syn->mlend, p + i, len - i)) > 0) {
+                j = i + n;
+                state = HL_STATE_NORMAL;
+            }
+        }
+        else if(state >= HL_STATE_STRING) {
+            cls = HL_STRING;
+            if(c == '\\' && i + 1 < len)
+                j = i + 2;
+            else if(c == syn->quotes[state - HL_STATE_STRING])
+                state = HL_STATE_NORMAL;
+        }
+        else if(syntax_match(syn->comment, p + i, len - i) > 0) {
+            cls = HL_COMMENT;
+            j = len;
+        }
+        else if((n = syntax_match(syn->mlstart, p + i, len - i)) > 0) {
+            cls = HL_COMMENT;
+            j = i + n;
+            state = HL_STATE_COMMENT;
+        }
+        else if(c != '\0' && strchr(syn->quotes, c) != NULL) {
+            cls = HL_STRING;
+            state = HL_STATE_STRING + (strchr(syn->quotes, c) - syn->quotes);
+        }
+        else if(i > 0 && (isalnum((unsigned char)p[i - 1]) || p[i - 1] == '_'
+                || p[i - 1] == '#')) {
+            // Rest of a word that was not highlighted.
+            cls = HL_NORMAL;
+        }
+        else if((syn->flags & HL_NUMBERS) && isdigit((unsigned char)c)) {
+            cls = HL_NUMBER;
+            while(j < len && (isalnum((unsigned char)p[j])
+                    || (p[j] != '\0' && strchr(syn->numchars, p[j]))))
+                j++;
+        }
+        else if(isalpha((unsigned char)c) || c == '_' || c == '#') {
+            while(j < len && (isalnum((unsigned char)p[j]) || p[j] == '_'))
+                j++;
+            cls = syntax_isword(syn->keywords, p + i, j - i) ? HL_KEYWORD
+                : syntax_isword(syn->types, p + i, j - i) ? HL_TYPE
+                : HL_NORMAL;
+        }
+        else {
+            cls = HL_NORMAL;
+        }
+
+        // Store classes of the visible part.
+        for(; i < j; i++) {
+            if(hl != NULL && i >= from && i < upto)
+                hl[i - from] = cls;
+        }
+    }
+
+    // Strings end with the line unless they may span lines.
+    if(i >= len && state >= HL_STATE_STRING && !(syn->flags & HL_MLSTRINGS))
+        state = HL_STATE_NORMAL;
+    return state;
+}
+
+/* ---------------------------- UTF-8 Stuff ------------------------- */
+
+/* Get length of the run of plain ASCII at p, bytes that take exactly one
+ * column each (so no tabs, nor the last byte before a combining mark).
+ * Checked a block at a time, so mostly ASCII text costs next to nothing.
+ */
+size_t utf8_plain(const char *p, size_t len)
+{
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    const __m256i tab32 = _mm256_set1_epi8('\t');
+    for(; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        if(_mm256_movemask_epi8(v)
+                | _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, tab32)))
+            break;
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i tab16 = _mm_set1_epi8('\t');
+    for(; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        if(_mm_movemask_epi8(v)
+                | _mm_movemask_epi8(_mm_cmpeq_epi8(v, tab16)))
+            break;
+    }
+#else
+    // High bit set, or a zero byte after xor with tabs.
+    for(; i + 8 <= len; i += 8) {
+        uint64_t x, t;
+
+        memcpy(&x, p + i, 8);
+        t = x ^ 0x0909090909090909ULL;
+        if((x | ((t - 0x0101010101010101ULL) & ~t)) & 0x8080808080808080ULL)
+            break;
+    }
+#endif
+    while(i < len && (unsigned char)p[i] < 0x80 && p[i] != '\t')
+        i++;
+
+    // Byte before non-ASCII may be the base of a combining mark.
+    if(i > 0 && i < len && (unsigned char)p[i] >= 0x80)
+        i--;
+    return i;
+}
+/* Decode UTF-8 sequence at p, returning its length (0 if not valid).
+ */
+size_t utf8_decode(const char *p, size_t len, uint32_t *cp)
+{
+    const unsigned char *s = (const unsigned char *)p;
+    uint32_t c = s[0];
+    size_t i, n;
+
+    if(c < 0x80) {
+        *cp = c;
+        return 1;
+    }
+    if(c >= 0xC2 && c <= 0xDF) {
+        n = 2;
+        c &= 0x1F;
+    }
+    else if(c >= 0xE0 && c <= 0xEF) {
+        n = 3;
+        c &= 0x0F;
+    }
+    else if(c >= 0xF0 && c <= 0xF4) {
+        n = 4;
+        c &= 0x07;
+    }
+    else {
+        return 0;
+    }
+    if(n > len) return 0;
+    for(i = 1; i < n; i++) {
+        if((s[i] & 0xC0) != 0x80)
+            return 0;
+        c = (c << 6) | (s[i] & 0x3F);
+    }
+
+    // Overlong, surrogate or out of range.
+    if((n == 3 && c < 0x800) || (n == 4 && (c < 0x10000 || c > 0x10FFFF))
+            || (c >= 0xD800 && c <= 0xDFFF))
+        return 0;
+    *cp = c;
+    return n;
+}
+/* Get length of character at p, a code point and the combining marks
+ * after it, and the columns it takes. Bytes that are not valid UTF-8 or
+ * not printable take one column.
+ */
+size_t utf8_char(const char *p, size_t len, int *width)
+{
+    size_t n, m;
+    uint32_t cp;
+    int w;
+
+    *width = 1;
+    if((n = utf8_decode(p, len, &cp)) == 0)
+        return 1;
+    if((w = wcwidth(cp)) <= 0)
+        return n;
+    *width = w;
+
+    // Combining marks join the character before them.
+    while(n < len && (unsigned char)p[n] >= 0x80
+            && (m = utf8_decode(p + n, len - n, &cp)) > 0
+            && wcwidth(cp) == 0)
+        n += m;
+    return n;
+}
 
 /* ---------------------------- Editor Stuff ------------------------- */
 
 #define EDITOR_PAIR 1
 #define STATUS_PAIR 2
+#define SYNTAX_PAIR 3
 
 #define MAXSKIPROW 20
 #define MAXTABSTOP 4
 
+#define INDEX_MAGIC "PSX1"
+#define INDEX_MINSIZE (1024L * 1024L)
+#define INDEX_PARALLEL (8L * 1024L * 1024L)
+#define INDEX_HEADSIZE (256L * 1024L)
+#define INDEX_MAXTHREADS 8
+#define INDEX_CHECKINIT 2166136261u
+
+#define VCOL_CACHE 128
+#define VCOL_STEP 256
+
+#define SAVE_MAGIC "PSR2"
+#define SAVE_MAXDIRTY 2
+
+typedef struct index_chunk {
+    const char *data;
+    long unsigned start, end;
+    long unsigned *lines;
+    long count, cap;
+    bool error;
+} index_chunk_t;
+
+typedef struct vcol_mark {
+    long unsigned byte;
+    long unsigned col;
+    bool plain;
+} vcol_mark_t;
+
+typedef struct vcol_line {
+    long line;
+    bool plain;
+    long nmarks, cap;
+    vcol_mark_t *marks;
+} vcol_line_t;
+
+typedef struct extent {
+    long unsigned start, end;
+    long delta;
+} extent_t;
+
+typedef struct indexer {
+    bool pending;
+    int nthreads;
+    char save[512];
+    pthread_t threads[INDEX_MAXTHREADS];
+    index_chunk_t chunks[INDEX_MAXTHREADS + 1];
+} indexer_t;
+
+typedef struct wrap {
+    bool on;
+    bool stale;
+    int cols;
+    long count, cap;
+    long gap, gapsize;
+    long unsigned *width;
+    long *tree;
+} wrap_t;
+
 typedef struct editor {
     int cx, cy;
     int rows, cols;
     long skipcols;
     long skiprows;
     long linecount;
+    long linecap;
+    long unsigned *lines;
+    indexer_t idx;
+    int tabstop;
+    vcol_line_t vcols[VCOL_CACHE];
+    wrap_t wrap;
+    const syntax_t *syntax;
+    unsigned char *hl;
+    long hlcap;
+    unsigned char *hlbuf;
+    long hlbufcap;
+    long hlline;
+    long unsigned hlfrom, hlupto;
+    extent_t *extents;
+    long nextents;
+    long extentcap;
+    bool rewrite;
+    long unsigned disksize;
+    uint64_t diskmtime;
     bool dirty;
+    bool modified;
     bool status_on;
     char status[80];
+    char filename[512];
     char *data;
-    char *findstr;
+    char findstr[80];
     long unsigned find;
     long unsigned size;
+    journal_t jnl;
 } editor_t;
 
 /* Initialise the editor structure.
@@ -41,6 +716,7 @@ typedef struct editor {
 editor_t editor_init(void)
 {
     editor_t e;
+    int i;
     e.cx = 0;
     e.cy = 0;
     e.rows = 0;
@@ -48,413 +724,2954 @@ editor_t editor_init(void)
     e.skipcols = 0;
     e.skiprows = 0;
     e.linecount = 0;
+    e.linecap = 0;
+    e.lines = NULL;
+    e.idx.pending = false;
+    e.tabstop = MAXTABSTOP;
+    for(i = 0; i < VCOL_CACHE; i++) {
+        e.vcols[i].line = -1;
+        e.vcols[i].nmarks = 0;
+        e.vcols[i].cap = 0;
+        e.vcols[i].marks = NULL;
+    }
+    e.wrap.on = false;
+    e.wrap.stale = true;
+    e.wrap.cols = 0;
+    e.wrap.count = -1;
+    e.wrap.cap = 0;
+    e.wrap.gap = 0;
+    e.wrap.gapsize = 0;
+    e.wrap.width = NULL;
+    e.wrap.tree = NULL;
+    e.syntax = NULL;
+    e.hl = NULL;
+    e.hlcap = 0;
+    e.hlbuf = NULL;
+    e.hlbufcap = 0;
+    e.hlline = -1;
+    e.hlfrom = 0;
+    e.hlupto = 0;
+    e.extents = NULL;
+    e.nextents = 0;
+    e.extentcap = 0;
+    e.rewrite = true;
+    e.disksize = 0;
+    e.diskmtime = 0;
     e.find = 0;
-    e.findstr = NULL;
+    e.findstr[0] = '\0';
     e.status_on = false;
     e.dirty = true;
+    e.modified = false;
     e.data = NULL;
     e.size = 0;
     memset(e.status, 0, sizeof(e.status));
+    memset(e.filename, 0, sizeof(e.filename));
+    journal_init(&e.jnl);
     return e;
 }
 /* Destroy editor data.
  */
 void editor_free(editor_t *e)
 {
+    extern bool editor_waitindex(editor_t *e);
+    int i;
+
+    editor_waitindex(e);
+    free(e->data);
+    free(e->lines);
+    free(e->extents);
+    for(i = 0; i < VCOL_CACHE; i++)
+        free(e->vcols[i].marks);
+    free(e->wrap.width);
+    free(e->wrap.tree);
+    free(e->hl);
+    free(e->hlbuf);
+}
+/* Drop buffer contents and everything worked out from them, keeping the
+ * cursor, settings and ranges changed since last save.
+ */
+void editor_unload(editor_t *e)
+{
+    extern bool editor_waitindex(editor_t *e);
+    int i;
+
+    editor_waitindex(e);
     free(e->data);
+    free(e->lines);
+    e->data = NULL;
+    e->lines = NULL;
+    e->linecap = 0;
+    for(i = 0; i < VCOL_CACHE; i++) {
+        free(e->vcols[i].marks);
+        e->vcols[i].line = -1;
+        e->vcols[i].nmarks = 0;
+        e->vcols[i].cap = 0;
+        e->vcols[i].marks = NULL;
+    }
+    free(e->wrap.width);
+    free(e->wrap.tree);
+    e->wrap.stale = true;
+    e->wrap.count = -1;
+    e->wrap.cap = 0;
+    e->wrap.gap = 0;
+    e->wrap.gapsize = 0;
+    e->wrap.width = NULL;
+    e->wrap.tree = NULL;
+    free(e->hl);
+    free(e->hlbuf);
+    e->hl = NULL;
+    e->hlcap = 0;
+    e->hlbuf = NULL;
+    e->hlbufcap = 0;
+    e->hlline = -1;
+}
+/* Get number of bytes of memory held by the editor.
+ */
+long unsigned editor_memory(editor_t *e)
+{
+    long unsigned total = 0;
+    int i;
+
+    if(e->data != NULL)
+        total += e->size + 1;
+    total += sizeof(long unsigned) * e->linecap;
+    total += (sizeof(long unsigned) + sizeof(long)) * e->wrap.cap;
+    total += e->hlcap + e->hlbufcap;
+    total += sizeof(extent_t) * e->extentcap;
+    for(i = 0; i < VCOL_CACHE; i++)
+        total += sizeof(vcol_mark_t) * e->vcols[i].cap;
+    return total;
 }
 /* Get line from given offset in file.
  */
 long unsigned editor_getline(editor_t *e, long unsigned offset)
 {
-    long unsigned i, nlines = 0;
+    long lo = 0, hi = e->linecount;
 
-    for(i = 0; i < e->size && i != offset; i++) {
-        if(e->data[i] == '\n' || e->data[i] == '\0')
-            nlines++;
+    if(offset > e->size) offset = e->size;
+
+    // Find last line starting at or before offset.
+    while(lo < hi) {
+        long mid = lo + (hi - lo + 1) / 2;
+        if(e->lines[mid] <= offset)
+            lo = mid;
+        else
+            hi = mid - 1;
     }
-    return nlines;
+    return lo;
 }
 /* Get offset of given line in file.
  */
 long unsigned editor_getoffset(editor_t *e, long line_num)
 {
-    long nlines = 0;
-    long unsigned i;
+    // Lines past the head are unknown while the index is being built.
+    if(line_num < 0 || line_num > e->linecount)
+        return e->idx.pending ? e->idx.chunks[0].end : e->size;
+    return e->lines[line_num];
+}
+/* Get length of given line, without the new line.
+ */
+long unsigned editor_linelen(editor_t *e, long line)
+{
+    long unsigned startx = editor_getoffset(e, line);
+    long unsigned endx = editor_getoffset(e, line + 1);
 
-    for(i = 0; i < e->size && line_num != nlines; i++) {
-        if(e->data[i] == '\n' || e->data[i] == '\0')
-            nlines++;
-    }
-    return i;
+    if(endx > startx && e->data[endx - 1] == '\n')
+        endx--;
+    return endx - startx;
 }
-/* Get total number of lines in file.
+/* Make room for lexer states of given number of lines (new ones unknown).
  */
-void editor_getlinecount(editor_t *e)
+static int editor_hlgrow(editor_t *e, long n)
 {
-    long unsigned i, nlines = 0;
-    for(i = 0; i < e->size; i++) {
-        if(e->data[i] == '\n')
-            nlines++;
-    }
-    e->linecount = nlines;
+    unsigned char *hl;
+    long cap = e->hlcap > 0 ? e->hlcap : 1024;
+
+    if(n <= e->hlcap) return 0;
+    while(cap < n)
+        cap *= 2;
+    if((hl = realloc(e->hl, cap)) == NULL)
+        return 1;
+    memset(hl + e->hlcap, HL_STATE_UNKNOWN, cap - e->hlcap);
+    e->hl = hl;
+    e->hlcap = cap;
+    return 0;
 }
-/* Convert CR/LF in to LF.
+/* Lex whole line from given state, returning state at its end.
  */
-void editor_convnewline(editor_t *e)
+static int editor_hllex(editor_t *e, long line, int state)
 {
-    extern void editor_delchr(editor_t *e, long unsigned at);
-    long unsigned i;
+    long unsigned len = editor_linelen(e, line);
 
-    for(i = 0; i < e->size; i++) {
-        if(e->data[i] == '\r')
-            editor_delchr(e, i);
-    }
+    return syntax_lex(e->syntax, e->data + editor_getoffset(e, line), len,
+        state, NULL, 0, len);
 }
-/* Convert tabs to spaces and back again.
+/* Get lexer state at start of given line. Unknown states are lexed from
+ * the nearest known one, or assumed normal HL_SYNC lines back.
  */
-void editor_convtab(editor_t *e, bool totab)
+int editor_hlstate(editor_t *e, long line)
 {
-    extern void editor_inschr(editor_t *e, long unsigned at, char ch);
-    extern void editor_delchr(editor_t *e, long unsigned at);
-    long unsigned i;
+    long j;
+    int state;
 
-    for(i = 0; i < e->size; i++) {
-        if(e->size > 2) {
-            if(totab) { // Convert to tabs.
-                if(e->data[i] == '\n' && e->data[i + 1] == ' ') {
-                    short unsigned spaces = 0;
-                    while(e->data[i + 1] == ' ') {
-                        ++spaces;
-                        editor_delchr(e, i + 1);
-                        if(spaces == MAXTABSTOP) {
-                            spaces = 0;
-                            editor_inschr(e, i + 1, '\t');
-                            ++i;
-                        }
-                    }
-                }
-            }
-            else { // Convert to spaces.
-                if(e->data[i] == '\n' && e->data[i + 1] == '\t') {
-                    while(e->data[i + 1] == '\t') {
-                        short unsigned spaces = 0;
-                        editor_delchr(e, i + 1);
-                        while(spaces < MAXTABSTOP) {
-                            editor_inschr(e, i + 1, ' ');
-                            ++spaces;
-                        }
-                        i += spaces;
-                    }
-                }
-            }
-        }
+    if(line <= 0) return HL_STATE_NORMAL;
+    if(line > e->linecount) line = e->linecount;
+    if(editor_hlgrow(e, line + 1) != 0)
+        return HL_STATE_NORMAL;
+    if(e->hl[line] != HL_STATE_UNKNOWN)
+        return e->hl[line];
+
+    for(j = line - 1; j > 0 && j > line - HL_SYNC; j--) {
+        if(e->hl[j] != HL_STATE_UNKNOWN)
+            break;
+    }
+    state = (j <= 0 || e->hl[j] == HL_STATE_UNKNOWN)
+        ? HL_STATE_NORMAL : e->hl[j];
+    for(j = j < 0 ? 0 : j; j < line; j++) {
+        e->hl[j] = state;
+        state = editor_hllex(e, j, state);
     }
+    e->hl[line] = state;
+    return state;
 }
-/* Get query string for searching.
+/* Lex again from an edited line until states match those cached.
  */
-char *editor_findprompt(editor_t *e, const char *string)
+void editor_hlchange(editor_t *e, long line)
 {
-    void editor_setstatus(editor_t *e, const char *fmt, ...);
-    void editor_renderstatus(editor_t *e);
-    static char query[80];
-    int c, i, cx, cy, newx, newy;
+    long k;
+    int state;
 
-    // Save original cx and cy
-    cx = e->cx;
-    cy = e->cy;
-    editor_setstatus(e, "Find: ");
-    if(has_colors())
-        attron(COLOR_PAIR(STATUS_PAIR));
-    editor_renderstatus(e);
-    if(has_colors())
-        attroff(COLOR_PAIR(STATUS_PAIR));
-    getyx(stdscr, newy, newx);
+    if(e->syntax == NULL || e->hl == NULL) return;
+    state = editor_hlstate(e, line);
+    for(k = line; k < e->linecount && k - line < HL_MAXRELEX; k++) {
+        state = editor_hllex(e, k, state);
+        if(editor_hlgrow(e, k + 2) != 0)
+            return;
 
-    // Get string
-    for(i = 0; i < 80 && (c = getch()) != '\n'; ) {
-        if(c == '\x1b') {
-            return NULL;
-        }
-        else if(c == KEY_BACKSPACE || c == 127) {
-            if(i > 0) {
-                query[--i] = '\0';
-                if(has_colors())
-                    attron(COLOR_PAIR(STATUS_PAIR));
-                mvaddch(newy, --newx, ' ');
-                if(has_colors())
-                    attroff(COLOR_PAIR(STATUS_PAIR));
-                move(newy, newx);
-            }
-        }
-        else {
-            if(i < 80 && i < (e->cols - 7) && isprint(c)) {
-                query[i++] = c;
-                if(has_colors())
-                    attron(COLOR_PAIR(STATUS_PAIR));
-                mvaddch(newy, newx++, c);
-                if(has_colors())
-                    attroff(COLOR_PAIR(STATUS_PAIR));
-            }
-        }
+        // Converged, or nothing cached past here that could be stale.
+        if(e->hl[k + 1] == state
+                || (e->hl[k + 1] == HL_STATE_UNKNOWN && k > line))
+            return;
+        e->hl[k + 1] = state;
     }
-    query[i] = '\0';
 
-    // Restore cx and cy
-    e->cx = cx;
-    e->cy = cy;
-    return query;
+    // Gave up, lines after are lexed again when shown.
+    if(k + 1 < e->hlcap)
+        memset(&e->hl[k + 1], HL_STATE_UNKNOWN, e->hlcap - k - 1);
 }
-/* Search through a file with the editor.
+/* Get number of columns a tab takes at given column.
  */
-void editor_find(editor_t *e, const char *query)
+static long unsigned editor_tabwidth(editor_t *e, long unsigned col)
 {
-    char *p;
-
+    return e->tabstop - col % e->tabstop;
+}
+/* Get length of character at p and the columns it takes at given column.
+ */
+static size_t editor_char(editor_t *e, const char *p, size_t len,
+    long unsigned col, long unsigned *width)
+{
+    size_t n = 1;
+    int w = 1;
+
+    if(*p == '\t')
+        *width = editor_tabwidth(e, col);
+    else {
+        // ASCII followed by non-ASCII may carry combining marks.
+        if((unsigned char)*p >= 0x80
+                || (len > 1 && (unsigned char)p[1] >= 0x80))
+            n = utf8_char(p, len, &w);
+        *width = w;
+    }
+    return n;
+}
+/* Get visual column cache of given line, building it if needed. Lines
+ * of plain ASCII need none, others get a checkpoint of byte and column
+ * at least every VCOL_STEP bytes. Long runs of plain ASCII are covered
+ * by a single checkpoint.
+ */
+static vcol_line_t *editor_vcols(editor_t *e, long line)
+{
+    vcol_line_t *v;
+    const char *start;
+    long unsigned at, col = 0, len, width, stop;
+
+    if(line < 0) line = 0;
+    v = &e->vcols[line % VCOL_CACHE];
+    if(v->line == line)
+        return v;
+
+    v->line = line;
+    v->nmarks = 0;
+    start = e->data + editor_getoffset(e, line);
+    len = editor_linelen(e, line);
+    at = utf8_plain(start, len);
+    v->plain = at == len;
+    if(v->plain)
+        return v;
+
+    for(at = 0; at < len; ) {
+        long unsigned run = utf8_plain(start + at, len - at);
+        vcol_mark_t *m;
+
+        if(v->nmarks == v->cap) {
+            long cap = v->cap > 0 ? v->cap * 2 : 16;
+            vcol_mark_t *marks = realloc(v->marks, sizeof(vcol_mark_t) * cap);
+
+            if(marks == NULL) {
+                // Scan on from the last checkpoint, but build it again
+                // next time.
+                if(v->nmarks > 0)
+                    v->marks[v->nmarks - 1].plain = false;
+                v->line = -1;
+                break;
+            }
+            v->marks = marks;
+            v->cap = cap;
+        }
+        m = &v->marks[v->nmarks++];
+        m->byte = at;
+        m->col = col;
+        m->plain = run >= VCOL_STEP || at + run == len;
+        if(m->plain) {
+            at += run;
+            col += run;
+            continue;
+        }
+        for(stop = at + VCOL_STEP; at < len && at < stop; col += width) {
+            run = utf8_plain(start + at, len - at);
+            if(run > stop - at)
+                run = stop - at;
+            at += run;
+            col += run;
+            width = 0;
+            if(at < len && at < stop)
+                at += editor_char(e, start + at, len - at, col, &width);
+        }
+    }
+    return v;
+}
+/* Drop visual column cache of given line (and all after it).
+ */
+void editor_dropcols(editor_t *e, long line, bool after)
+{
+    int i;
+
+    for(i = 0; i < VCOL_CACHE; i++) {
+        if(e->vcols[i].line == line || (after && e->vcols[i].line > line))
+            e->vcols[i].line = -1;
+    }
+}
+/* Find last checkpoint of a line at or before given byte, or column.
+ */
+static vcol_mark_t editor_findmark(vcol_line_t *v, long unsigned at,
+    bool bycol)
+{
+    vcol_mark_t m = { 0, 0, v->plain };
+    long lo = 0, hi = v->nmarks;
+
+    while(lo < hi) {
+        long mid = lo + (hi - lo) / 2;
+        if((bycol ? v->marks[mid].col : v->marks[mid].byte) <= at)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo > 0 ? v->marks[lo - 1] : m;
+}
+/* Get visual column of given byte in a line, bytes inside a character
+ * are at the column it starts at.
+ */
+long unsigned editor_bytetocol(editor_t *e, long line, long unsigned byte)
+{
+    vcol_line_t *v = editor_vcols(e, line);
+    vcol_mark_t m = editor_findmark(v, byte, false);
+    const char *start = e->data + editor_getoffset(e, line);
+    long unsigned at, col, len, width, n;
+
+    if(m.plain)
+        return m.col + (byte - m.byte);
+
+    // Walk characters from the checkpoint, skipping plain runs.
+    len = editor_linelen(e, line);
+    for(at = m.byte, col = m.col; at < byte && at < len; col += width) {
+        n = utf8_plain(start + at, len - at);
+        if(n > byte - at)
+            n = byte - at;
+        at += n;
+        col += n;
+        if(at >= byte || at >= len)
+            break;
+        n = editor_char(e, start + at, len - at, col, &width);
+        if(at + n > byte)
+            return col;
+        at += n;
+    }
+    return col + (byte > at ? byte - at : 0);
+}
+/* Get byte of a line shown at given visual column, the start of the
+ * character covering it.
+ */
+long unsigned editor_coltobyte(editor_t *e, long line, long unsigned col)
+{
+    vcol_line_t *v = editor_vcols(e, line);
+    vcol_mark_t m = editor_findmark(v, col, true);
+    const char *start = e->data + editor_getoffset(e, line);
+    long unsigned at, c, len = editor_linelen(e, line), width, n;
+
+    if(m.plain) {
+        at = m.byte + (col - m.col);
+        return at > len ? len : at;
+    }
+
+    for(at = m.byte, c = m.col; at < len; c += width) {
+        n = utf8_plain(start + at, len - at);
+        if(col < c + n)
+            return at + (col - c);
+        at += n;
+        c += n;
+        if(at >= len)
+            break;
+        n = editor_char(e, start + at, len - at, c, &width);
+        if(col < c + width)
+            return at;
+        at += n;
+    }
+    return len;
+}
+/* Get byte after the character at given byte of a line.
+ */
+long unsigned editor_nextchar(editor_t *e, long line, long unsigned byte)
+{
+    long unsigned len = editor_linelen(e, line), width;
+
+    if(byte >= len) return len;
+    return byte + editor_char(e, e->data + editor_getoffset(e, line) + byte,
+        len - byte, 0, &width);
+}
+/* Get byte of the character before given byte of a line.
+ */
+long unsigned editor_prevchar(editor_t *e, long line, long unsigned byte)
+{
+    long unsigned col = editor_bytetocol(e, line, byte);
+
+    return col > 0 ? editor_coltobyte(e, line, col - 1) : 0;
+}
+/* Get number of screen rows a line of given width wraps to. There is
+ * always room for the cursor past its end.
+ */
+static long editor_wraprows(editor_t *e, long unsigned width)
+{
+    return width / (e->cols > 0 ? e->cols : 1) + 1;
+}
+/* Make room in the wrap layout for given number of slots, lines after
+ * the gap are moved to the end so the gap takes the new slots.
+ */
+static int editor_wrapgrow(editor_t *e, long n)
+{
+    wrap_t *w = &e->wrap;
+    long unsigned *width;
+    long *tree, tail;
+    long cap = w->cap > 0 ? w->cap : 64;
+
+    if(n <= w->cap) return 0;
+    while(cap < n)
+        cap *= 2;
+    if((width = realloc(w->width, sizeof(long unsigned) * cap)) == NULL)
+        return 1;
+    w->width = width;
+    if((tree = realloc(w->tree, sizeof(long) * (cap + 1))) == NULL)
+        return 1;
+    w->tree = tree;
+    if(w->count >= 0) {
+        tail = w->count - w->gap;
+        memmove(&w->width[cap - tail], &w->width[w->gap + w->gapsize],
+            sizeof(long unsigned) * tail);
+        w->gapsize = cap - w->count;
+        w->stale = true;
+    }
+    w->cap = cap;
+    return 0;
+}
+/* Get slot of a line in the wrap layout.
+ */
+static long editor_wrapslot(wrap_t *w, long line)
+{
+    return line < w->gap ? line : line + w->gapsize;
+}
+/* Add rows to a slot of the row tree, unless it is summed again anyway.
+ */
+static void editor_wrapadd(editor_t *e, long slot, long delta)
+{
+    wrap_t *w = &e->wrap;
+
+    if(w->stale || w->cols != e->cols) return;
+    for(slot++; delta != 0 && slot <= w->cap; slot += slot & -slot)
+        w->tree[slot] += delta;
+}
+/* Bring wrap layout up to date. Every line is measured when wrapping is
+ * turned on, the row tree is summed again when the screen is resized or
+ * the gap had to grow.
+ */
+static int editor_wrapsync(editor_t *e)
+{
+    wrap_t *w = &e->wrap;
+    long i, j;
+
+    if(w->count < 0) {
+        if(editor_wrapgrow(e, e->linecount + e->linecount / 8 + 64) != 0)
+            return 1;
+        for(i = 0; i < e->linecount; i++)
+            w->width[i] = editor_bytetocol(e, i, editor_linelen(e, i));
+        w->count = e->linecount;
+        w->gap = w->count;
+        w->gapsize = w->cap - w->count;
+        w->stale = true;
+    }
+    if(!w->stale && w->cols == e->cols)
+        return 0;
+
+    // Fenwick tree of rows per slot, built in place. Slots in the gap
+    // have no rows.
+    for(i = 1; i <= w->cap; i++) {
+        w->tree[i] = i - 1 >= w->gap && i - 1 < w->gap + w->gapsize
+            ? 0 : editor_wraprows(e, w->width[i - 1]);
+    }
+    for(i = 1; i <= w->cap; i++) {
+        j = i + (i & -i);
+        if(j <= w->cap)
+            w->tree[j] += w->tree[i];
+    }
+    w->cols = e->cols;
+    w->stale = false;
+    return 0;
+}
+/* Check if lines are wrapped, screen rows are then counted over the
+ * wrap layout instead of one per line.
+ */
+static bool editor_wrapping(editor_t *e)
+{
+    if(!e->wrap.on || e->cols <= 0)
+        return false;
+    if(editor_wrapsync(e) != 0) {
+        // Out of memory, fall back to scrolling sideways from the top.
+        e->wrap.on = false;
+        e->wrap.count = -1;
+        e->cx = e->cy = 0;
+        e->skipcols = e->skiprows = 0;
+        return false;
+    }
+    return true;
+}
+/* Get first screen row of given line when wrapping.
+ */
+static long editor_wrapstart(editor_t *e, long line)
+{
+    long row = 0;
+
+    if(line > e->wrap.count)
+        line = e->wrap.count;
+    for(line = editor_wrapslot(&e->wrap, line); line > 0; line -= line & -line)
+        row += e->wrap.tree[line];
+    return row;
+}
+/* Get line shown on given screen row when wrapping, and which of its
+ * rows it is.
+ */
+static long editor_wrapline(editor_t *e, long row, long *sub)
+{
+    wrap_t *w = &e->wrap;
+    long slot = 0, step = 1;
+
+    // Descend the tree to the last slot starting at or before row, never
+    // one in the gap as those have no rows.
+    while(step * 2 <= w->cap)
+        step *= 2;
+    for(; step > 0; step /= 2) {
+        if(slot + step <= w->cap && w->tree[slot + step] <= row) {
+            slot += step;
+            row -= w->tree[slot];
+        }
+    }
+    *sub = row;
+    return slot < w->gap ? slot : slot - w->gapsize;
+}
+/* Measure an edited line again, keeping the wrap layout in step.
+ */
+static void editor_wrapchange(editor_t *e, long line)
+{
+    wrap_t *w = &e->wrap;
+    long unsigned width;
+    long slot;
+
+    if(line < 0 || line >= w->count) return;
+    slot = editor_wrapslot(w, line);
+    width = editor_bytetocol(e, line, editor_linelen(e, line));
+    editor_wrapadd(e, slot, editor_wraprows(e, width)
+        - editor_wraprows(e, w->width[slot]));
+    w->width[slot] = width;
+}
+/* Get total number of screen rows, one per line unless wrapping.
+ */
+long editor_rowcount(editor_t *e)
+{
+    if(!editor_wrapping(e))
+        return e->linecount;
+    return editor_wrapstart(e, e->wrap.count);
+}
+/* Get line and visual column under the cursor.
+ */
+static long editor_curpos(editor_t *e, long unsigned *col)
+{
+    long line, sub;
+
+    if(!editor_wrapping(e)) {
+        *col = e->cx + e->skipcols;
+        return e->cy + e->skiprows;
+    }
+    line = editor_wrapline(e, e->cy + e->skiprows, &sub);
+    *col = sub * e->cols + e->cx;
+    return line;
+}
+/* Get line the cursor is on.
+ */
+long editor_curline(editor_t *e)
+{
+    long unsigned col;
+
+    return editor_curpos(e, &col);
+}
+/* Get byte of current line under the cursor.
+ */
+long unsigned editor_cursor(editor_t *e)
+{
+    long unsigned col;
+    long line = editor_curpos(e, &col);
+
+    return editor_coltobyte(e, line, col);
+}
+/* Put cursor on given byte of a line, scrolling so it is shown.
+ */
+void editor_moveto(editor_t *e, long line, long unsigned byte)
+{
+    long col = editor_bytetocol(e, line, byte);
+    long row = line;
+
+    if(editor_wrapping(e)) {
+        row = editor_wrapstart(e, line) + col / e->cols;
+        col %= e->cols;
+    }
+    else if(col < e->skipcols) {
+        e->skipcols = col;
+        e->dirty = true;
+    }
+    else if(col >= e->skipcols + e->cols) {
+        e->skipcols = col - e->cols + 1;
+        e->dirty = true;
+    }
+    e->cx = col - e->skipcols;
+
+    if(row < e->skiprows) {
+        e->skiprows = row;
+        e->dirty = true;
+    }
+    else if(row > e->skiprows + e->rows - 2) {
+        e->skiprows = row - (e->rows - 2);
+        e->dirty = true;
+    }
+    e->cy = row - e->skiprows;
+}
+/* Put cursor on given byte of current line.
+ */
+void editor_setcursor(editor_t *e, long unsigned byte)
+{
+    editor_moveto(e, editor_curline(e), byte);
+}
+/* Keep cursor inside current line after moving up or down.
+ */
+void editor_snapcursor(editor_t *e)
+{
+    long unsigned byte, at, col;
+    long line = editor_curpos(e, &col);
+
+    byte = editor_coltobyte(e, line, col);
+    at = editor_bytetocol(e, line, byte);
+    if(at == col)
+        return;
+
+    if(editor_wrapping(e)) {
+        // Tab or wide character ending a wrapped row would pull the
+        // cursor back up.
+        if(at < col - e->cx)
+            byte = editor_nextchar(e, line, byte);
+        editor_moveto(e, line, byte);
+        return;
+    }
+
+    // Snap to end of line, short lines are shown from the start.
+    if(at < (long unsigned)e->cols) {
+        e->skipcols = 0;
+        e->cx = at;
+    }
+    else if(at < (long unsigned)e->skipcols
+            || at >= (long unsigned)(e->skipcols + e->cols)) {
+        e->skipcols = at - e->cols + 1;
+        e->cx = e->cols - 1;
+    }
+    else {
+        e->cx = at - e->skipcols;
+    }
+    e->dirty = true;
+}
+/* Change wrap mode, tab width or screen size, keeping the cursor on the
+ * same character and the same line at the top of the screen.
+ */
+void editor_layout(editor_t *e, bool wrap, int tabstop, int rows, int cols)
+{
+    long unsigned col, at;
+    long sub, top = e->skiprows;
+    long line = editor_curpos(e, &col);
+
+    at = editor_coltobyte(e, line, col);
+    if(editor_wrapping(e))
+        top = editor_wrapline(e, e->skiprows, &sub);
+
+    if(tabstop != e->tabstop) {
+        e->tabstop = tabstop;
+        editor_dropcols(e, 0, true);
+        e->wrap.count = -1;
+    }
+    if(!wrap)
+        e->wrap.count = -1;
+    e->wrap.on = wrap;
+    e->rows = rows;
+    e->cols = cols;
+    if(editor_wrapping(e)) {
+        e->skiprows = editor_wrapstart(e, top);
+        e->skipcols = 0;
+    }
+    else {
+        e->skiprows = top;
+    }
+    editor_moveto(e, line, at);
+    e->dirty = true;
+}
+/* Make room for given number of entries in the line index.
+ */
+static int editor_growlines(editor_t *e, long n)
+{
+    long unsigned *lines;
+    long cap = e->linecap > 0 ? e->linecap : 64;
+
+    if(n <= e->linecap) return 0;
+    while(cap < n)
+        cap *= 2;
+    lines = realloc(e->lines, sizeof(long unsigned) * cap);
+    if(lines == NULL)
+        return 1;
+    e->lines = lines;
+    e->linecap = cap;
+    return 0;
+}
+/* Scan a chunk of the buffer, collecting offsets of line starts.
+ */
+static void *index_scan(void *arg)
+{
+    index_chunk_t *c = arg;
+    const char *p = c->data + c->start, *end = c->data + c->end;
+
+    while(p < end && (p = memchr(p, '\n', end - p)) != NULL) {
+        if(c->count == c->cap) {
+            long cap = c->cap > 0 ? c->cap * 2 : 1024;
+            long unsigned *lines = realloc(c->lines,
+                sizeof(long unsigned) * cap);
+
+            if(lines == NULL) {
+                c->error = true;
+                break;
+            }
+            c->lines = lines;
+            c->cap = cap;
+        }
+        c->lines[c->count++] = ++p - c->data;
+    }
+    return NULL;
+}
+/* Start rebuilding the line index. The head of the buffer is indexed
+ * before returning, the rest by worker threads for large buffers. Once
+ * complete the index is cached for file save (may be NULL).
+ */
+void editor_startindex(editor_t *e, const char *save)
+{
+    extern bool editor_waitindex(editor_t *e);
+    indexer_t *ix = &e->idx;
+    index_chunk_t *head = &ix->chunks[0];
+    long unsigned step, at;
+    int i, n = 0;
+
+    editor_waitindex(e);
+    editor_dropcols(e, 0, true);
+    if(editor_growlines(e, 1) != 0) return;
+    memset(ix->chunks, 0, sizeof(ix->chunks));
+    ix->pending = true;
+    ix->nthreads = 0;
+    snprintf(ix->save, sizeof(ix->save), "%s", save != NULL ? save : "");
+
+    // Split rest of large buffers between worker threads.
+    head->data = e->data;
+    head->end = e->size;
+    if(e->size >= INDEX_PARALLEL) {
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+        n = n < 1 ? 1 : n > INDEX_MAXTHREADS ? INDEX_MAXTHREADS : n;
+        head->end = INDEX_HEADSIZE;
+        step = (e->size - head->end + n - 1) / n;
+        for(i = 1, at = head->end; i <= n; i++, at += step) {
+            index_chunk_t *c = &ix->chunks[i];
+
+            c->data = e->data;
+            c->start = at;
+            c->end = at + step < e->size ? at + step : e->size;
+            if(pthread_create(&ix->threads[i - 1], NULL, index_scan, c) != 0)
+                break;
+        }
+        ix->nthreads = i - 1;
+
+        // Scan what could not be handed to a thread.
+        for(; i <= n; i++)
+            index_scan(&ix->chunks[i]);
+    }
+
+    // Head goes straight in to the line index, ready for first frame.
+    e->lines[0] = 0;
+    head->lines = e->lines;
+    head->cap = e->linecap;
+    head->count = 1;
+    index_scan(head);
+    e->lines = head->lines;
+    e->linecap = head->cap;
+    e->linecount = head->count - 1;
+    head->lines = NULL;
+}
+/* Wait for line index to complete and merge chunks in to it, returns
+ * true if there was work pending.
+ */
+bool editor_waitindex(editor_t *e)
+{
+    extern int editor_saveindex(editor_t *e, const char *filename);
+    indexer_t *ix = &e->idx;
+    bool error;
+    long total;
+    int i;
+
+    if(!ix->pending) return false;
+    ix->pending = false;
+    editor_dropcols(e, 0, true);
+    e->wrap.count = -1;
+    if(e->hl != NULL)
+        memset(e->hl, HL_STATE_UNKNOWN, e->hlcap);
+    for(i = 0; i < ix->nthreads; i++)
+        pthread_join(ix->threads[i], NULL);
+
+    // Prefix sum of chunk counts gives where each chunk lands.
+    error = ix->chunks[0].error;
+    total = e->linecount;
+    for(i = 1; i <= INDEX_MAXTHREADS && ix->chunks[i].data != NULL; i++) {
+        error |= ix->chunks[i].error;
+        total += ix->chunks[i].count;
+    }
+    if(!error && editor_growlines(e, total + 1) == 0) {
+        for(i = 1; i <= INDEX_MAXTHREADS && ix->chunks[i].data != NULL; i++) {
+            memcpy(&e->lines[e->linecount + 1], ix->chunks[i].lines,
+                sizeof(long unsigned) * ix->chunks[i].count);
+            e->linecount += ix->chunks[i].count;
+        }
+    }
+    for(i = 1; i <= INDEX_MAXTHREADS; i++)
+        free(ix->chunks[i].lines);
+    if(e->linecount != total)
+        return true;
+
+    // Cache index of a freshly opened file.
+    if(ix->save[0] != '\0')
+        editor_saveindex(e, ix->save);
+    return true;
+}
+/* Get total number of lines in file (rebuilding the line index).
+ */
+void editor_getlinecount(editor_t *e)
+{
+    editor_startindex(e, NULL);
+    editor_waitindex(e);
+}
+/* Move the gap of the wrap layout to just before given line. Lines passed
+ * over change slot, which is patched in the row tree unless far enough
+ * that summing it again is cheaper.
+ */
+static void editor_wrapgap(editor_t *e, long line)
+{
+    wrap_t *w = &e->wrap;
+    long k, r, gs = w->gapsize, d = line - w->gap;
+
+    if(d == 0 || gs == 0) {
+        w->gap = line;
+        return;
+    }
+    if((d < 0 ? -d : d) > w->cap / 32 + 64)
+        w->stale = true;
+    if(d < 0) {
+        for(k = line; k < w->gap; k++) {
+            r = editor_wraprows(e, w->width[k]);
+            editor_wrapadd(e, k, -r);
+            editor_wrapadd(e, k + gs, r);
+        }
+        memmove(&w->width[line + gs], &w->width[line],
+            sizeof(long unsigned) * -d);
+    }
+    else {
+        for(k = w->gap; k < line; k++) {
+            r = editor_wraprows(e, w->width[k + gs]);
+            editor_wrapadd(e, k + gs, -r);
+            editor_wrapadd(e, k, r);
+        }
+        memmove(&w->width[w->gap], &w->width[w->gap + gs],
+            sizeof(long unsigned) * d);
+    }
+    w->gap = line;
+}
+/* Add or remove a line of the wrap layout where the line index gained or
+ * lost one. The gap is moved there first, so the line takes or gives
+ * back a slot of it. Text after the last new line has no row, so a change
+ * there adds or removes the last row.
+ */
+static void editor_wrapshift(editor_t *e, long first, int delta)
+{
+    wrap_t *w = &e->wrap;
+
+    if(delta > 0) {
+        if(first > w->count)
+            first = w->count;
+        if(w->gapsize == 0
+                && editor_wrapgrow(e, w->cap + w->cap / 8 + 64) != 0) {
+            w->count = -1;
+            return;
+        }
+        editor_wrapgap(e, first);
+        w->width[first] = 0;
+        editor_wrapadd(e, first, editor_wraprows(e, 0));
+        w->gap++;
+        w->gapsize--;
+        w->count++;
+    }
+    else {
+        if(first >= w->count)
+            first = w->count - 1;
+        editor_wrapgap(e, first + 1);
+        editor_wrapadd(e, first, -editor_wraprows(e, w->width[first]));
+        w->gap = first;
+        w->gapsize++;
+        w->count--;
+    }
+}
+/* Update line index for a character inserted at given offset.
+ */
+static void editor_lineins(editor_t *e, long unsigned at, char ch)
+{
+    long i, first = editor_getline(e, at) + 1;
+
+    for(i = first; i <= e->linecount; i++)
+        e->lines[i]++;
+    if(ch == '\n' && editor_growlines(e, e->linecount + 2) == 0) {
+        memmove(&e->lines[first + 1], &e->lines[first],
+            sizeof(long unsigned) * (e->linecount + 1 - first));
+        e->lines[first] = at + 1;
+        e->linecount++;
+
+        // New line has no lexer state yet.
+        if(first < e->hlcap && editor_hlgrow(e, e->linecount + 1) == 0) {
+            memmove(&e->hl[first + 1], &e->hl[first], e->hlcap - first - 1);
+            e->hl[first] = HL_STATE_UNKNOWN;
+        }
+
+        // New line is measured once the edit is done.
+        if(e->wrap.count >= 0)
+            editor_wrapshift(e, first, 1);
+    }
+}
+/* Update line index for the character about to be deleted at given offset.
+ */
+static void editor_linedel(editor_t *e, long unsigned at)
+{
+    long i, first = editor_getline(e, at) + 1;
+
+    if(e->data[at] == '\n' && first <= e->linecount) {
+        memmove(&e->lines[first], &e->lines[first + 1],
+            sizeof(long unsigned) * (e->linecount - first));
+        e->linecount--;
+        if(first < e->hlcap) {
+            memmove(&e->hl[first], &e->hl[first + 1], e->hlcap - first - 1);
+            e->hl[e->hlcap - 1] = HL_STATE_UNKNOWN;
+        }
+        if(e->wrap.count >= 0)
+            editor_wrapshift(e, first, -1);
+    }
+    for(i = first; i <= e->linecount; i++)
+        e->lines[i]--;
+}
+/* Find first extent ending at or after given offset.
+ */
+static long editor_findextent(editor_t *e, long unsigned at)
+{
+    long lo = 0, hi = e->nextents;
+
+    while(lo < hi) {
+        long mid = lo + (hi - lo) / 2;
+        if(e->extents[mid].end < at)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+/* Add a new extent at given index of the extent list.
+ */
+static int editor_addextent(editor_t *e, long i, long unsigned at, long delta)
+{
+    if(e->nextents == e->extentcap) {
+        long cap = e->extentcap > 0 ? e->extentcap * 2 : 16;
+        extent_t *extents = realloc(e->extents, sizeof(extent_t) * cap);
+
+        if(extents == NULL) {
+            // Cannot track it, so next save writes everything.
+            e->rewrite = true;
+            return 1;
+        }
+        e->extents = extents;
+        e->extentcap = cap;
+    }
+    memmove(&e->extents[i + 1], &e->extents[i],
+        sizeof(extent_t) * (e->nextents - i));
+    e->extents[i].start = at;
+    e->extents[i].end = at + (delta > 0);
+    e->extents[i].delta = delta;
+    e->nextents++;
+    return 0;
+}
+/* Shift extents after given index and merge it with the next if touching.
+ */
+static void editor_shiftextent(editor_t *e, long i, long shift)
+{
+    long j;
+
+    for(j = i + 1; j < e->nextents; j++) {
+        e->extents[j].start += shift;
+        e->extents[j].end += shift;
+    }
+    if(i + 1 < e->nextents && e->extents[i].end >= e->extents[i + 1].start) {
+        e->extents[i].end = e->extents[i + 1].end;
+        e->extents[i].delta += e->extents[i + 1].delta;
+        memmove(&e->extents[i + 1], &e->extents[i + 2],
+            sizeof(extent_t) * (e->nextents - i - 2));
+        e->nextents--;
+    }
+}
+/* Mark a character inserted at given offset as differing from disk.
+ */
+static void editor_markins(editor_t *e, long unsigned at)
+{
+    long i = editor_findextent(e, at);
+
+    if(i < e->nextents && e->extents[i].start <= at) {
+        e->extents[i].end++;
+        e->extents[i].delta++;
+    }
+    else if(editor_addextent(e, i, at, 1) != 0) {
+        return;
+    }
+    editor_shiftextent(e, i, 1);
+}
+/* Mark the character about to be deleted at given offset.
+ */
+static void editor_markdel(editor_t *e, long unsigned at)
+{
+    long i = editor_findextent(e, at);
+
+    if(i < e->nextents && e->extents[i].start <= at) {
+        // Deleting inside an extent, or the byte right after it.
+        if(at < e->extents[i].end)
+            e->extents[i].end--;
+        e->extents[i].delta--;
+    }
+    else if(editor_addextent(e, i, at, -1) != 0) {
+        return;
+    }
+    editor_shiftextent(e, i, -1);
+}
+/* Checksum a block of memory (FNV-1a), continuing from given hash.
+ */
+static uint32_t index_checksum(uint32_t h, const unsigned char *p, size_t len)
+{
+    while(len-- > 0) {
+        h ^= *p++;
+        h *= 16777619u;
+    }
+    return h;
+}
+/* Header of line index sidecar file, followed by line lengths.
+ */
+typedef struct index_head {
+    char magic[4];
+    uint32_t check;
+    uint64_t ino;
+    uint64_t size;
+    uint64_t mtime;
+    uint64_t nlines;
+    uint64_t len;
+} index_head_t;
+
+/* Fill index header with identity of given file.
+ */
+static int index_stat(index_head_t *h, const char *filename)
+{
+    struct stat st;
+
+    if(stat(filename, &st) != 0)
+        return 1;
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, INDEX_MAGIC, 4);
+    h->ino = st.st_ino;
+    h->size = st.st_size;
+    h->mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000u
+        + st.st_mtim.tv_nsec;
+    return 0;
+}
+/* Load line index from sidecar file (<filename>.idx).
+ */
+int editor_loadindex(editor_t *e, const char *filename)
+{
+    const unsigned char *p, *end;
+    index_head_t head, file;
+    char name[512];
+    struct stat st;
+    void *map;
+    long i;
+    int fd;
+
+    if(e->size < INDEX_MINSIZE || index_stat(&file, filename) != 0)
+        return 1;
+    snprintf(name, sizeof(name), "%s.idx", filename);
+    if((fd = open(name, O_RDONLY)) < 0)
+        return 2;
+    if(fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(head)) {
+        close(fd);
+        return 3;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+        return 4;
+
+    // Cache must belong to this exact version of the file.
+    memcpy(&head, map, sizeof(head));
+    p = (const unsigned char *)map + sizeof(head);
+    end = (const unsigned char *)map + st.st_size;
+    if(memcmp(head.magic, file.magic, 4) || head.ino != file.ino
+            || head.size != file.size || head.mtime != file.mtime
+            || head.size != e->size || head.len != (uint64_t)(end - p)
+            || head.check != index_checksum(INDEX_CHECKINIT, p, head.len)
+            || editor_growlines(e, head.nlines + 1) != 0) {
+        munmap(map, st.st_size);
+        return 5;
+    }
+
+    // Decode line lengths back in to line offsets.
+    e->lines[0] = 0;
+    for(i = 1; i <= (long)head.nlines; i++) {
+        long unsigned len;
+        size_t n = journal_getnum(p, end - p, &len);
+
+        if(n == 0 || e->lines[i - 1] + len > e->size)
+            break;
+        e->lines[i] = e->lines[i - 1] + len;
+        p += n;
+    }
+    munmap(map, st.st_size);
+    if(i <= (long)head.nlines)
+        return 6;
+    e->linecount = head.nlines;
+    return 0;
+}
+/* Save line index to sidecar file (<filename>.idx).
+ */
+int editor_saveindex(editor_t *e, const char *filename)
+{
+    char name[512], tmp[512];
+    index_head_t head;
+    unsigned char *buf;
+    size_t len = 0;
+    const char *cache = getenv("PSEDIT_INDEXCACHE");
+    long i;
+    FILE *fp;
+
+    // Writing sidecars next to files is opt in, reading them is not.
+    if(cache == NULL || atoi(cache) <= 0)
+        return 1;
+    if(e->size < INDEX_MINSIZE || index_stat(&head, filename) != 0)
+        return 1;
+    if((buf = malloc(e->linecount * 10 + 1)) == NULL)
+        return 2;
+    for(i = 1; i <= e->linecount; i++)
+        len += journal_putnum(buf + len, e->lines[i] - e->lines[i - 1]);
+    head.nlines = e->linecount;
+    head.len = len;
+    head.check = index_checksum(INDEX_CHECKINIT, buf, len);
+
+    // Write to temporary file first, so a reader never sees half.
+    snprintf(name, sizeof(name), "%s.idx", filename);
+    snprintf(tmp, sizeof(tmp), "%s.idx.tmp", filename);
+    if((fp = fopen(tmp, "wb")) == NULL) {
+        free(buf);
+        return 3;
+    }
+    if(fwrite(&head, sizeof(head), 1, fp) != 1
+            || fwrite(buf, sizeof(char), len, fp) != len) {
+        fclose(fp);
+        free(buf);
+        remove(tmp);
+        return 4;
+    }
+    fclose(fp);
+    free(buf);
+    if(rename(tmp, name) != 0) {
+        remove(tmp);
+        return 5;
+    }
+    return 0;
+}
+/* Convert CR/LF in to LF (line index must be rebuilt after).
+ */
+void editor_convnewline(editor_t *e)
+{
+    char *p = memchr(e->data, '\r', e->size);
+    long unsigned i, j;
+
+    // Compact buffer in one pass from the first CR.
+    if(p == NULL) return;
+    for(i = j = p - e->data; i < e->size; i++) {
+        if(e->data[i] != '\r')
+            e->data[j++] = e->data[i];
+    }
+    e->size = j;
+    e->data[j] = 0;
+}
+/* Get query string for searching, valid until the next prompt.
+ */
+char *editor_findprompt(editor_t *e, const char *string)
+{
+    void editor_setstatus(editor_t *e, const char *fmt, ...);
+    void editor_renderstatus(editor_t *e);
+    static char query[80];
+    int c, i, cx, cy, newx, newy;
+
+    // Save original cx and cy
+    cx = e->cx;
+    cy = e->cy;
+    query[0] = '\0';
+    editor_setstatus(e, "%s", string);
+    if(has_colors())
+        attron(COLOR_PAIR(STATUS_PAIR));
+    editor_renderstatus(e);
+    if(has_colors())
+        attroff(COLOR_PAIR(STATUS_PAIR));
+    getyx(stdscr, newy, newx);
+
+    // Get string
+    for(i = 0; i < 80 && (c = getch()) != '\n'; ) {
+        if(c == '\x1b') {
+            return NULL;
+        }
+        else if(c == KEY_BACKSPACE || c == 127) {
+            if(i > 0) {
+                query[--i] = '\0';
+                if(has_colors())
+                    attron(COLOR_PAIR(STATUS_PAIR));
+                mvaddch(newy, --newx, ' ');
+                if(has_colors())
+                    attroff(COLOR_PAIR(STATUS_PAIR));
+                move(newy, newx);
+            }
+        }
+        else {
+            if(i < 79 && i < (e->cols - (int)strlen(string) - 1)
+                    && isprint(c)) {
+                query[i++] = c;
+                if(has_colors())
+                    attron(COLOR_PAIR(STATUS_PAIR));
+                mvaddch(newy, newx++, c);
+                if(has_colors())
+                    attroff(COLOR_PAIR(STATUS_PAIR));
+            }
+        }
+    }
+    query[i] = '\0';
+
+    // Restore cx and cy
+    e->cx = cx;
+    e->cy = cy;
+    return query;
+}
+/* Search through a file with the editor.
+ */
+void editor_find(editor_t *e, const char *query)
+{
+    char *p;
+
     // Search through the file.
     if(e->find >= e->size - 1) {
         e->find = 0;
     }
 
-    p = strstr(&e->data[e->find], query);
+    p = strstr(&e->data[e->find], query);
+
+    if(p == NULL) {
+        e->find = 0;
+        p = strstr(&e->data[e->find], query);
+    }
+
+    if(p != NULL) {
+        long unsigned offset = p - e->data;
+        long lines = editor_getline(e, offset);
+        long unsigned offset2 = editor_getoffset(e, lines);
+
+        // Scroll so the whole match is visible, cursor at its start.
+        e->skipcols = 0;
+        editor_moveto(e, lines, (offset - offset2) + strlen(query));
+        editor_moveto(e, lines, offset - offset2);
+        e->find = offset + strlen(query);
+    }
+}
+/* Move cursor to given line number (starting at one).
+ */
+void editor_gotoline(editor_t *e, long line)
+{
+    if(line > e->linecount)
+        line = e->linecount;
+    line = line > 0 ? line - 1 : 0;
+    e->skipcols = 0;
+    editor_moveto(e, line, 0);
+}
+/* Open a file with the editor.
+ */
+int editor_open(editor_t *e, const char *filename)
+{
+    long unsigned total, size;
+    index_head_t file;
+    FILE *fp;
+
+    // Try to open file.
+    if((fp = fopen(filename, "rb")) == NULL)
+        return 1;
+
+    // File is open so get length.
+    fseek(fp, 0, SEEK_END);
+    e->size = ftell(fp);
+    rewind(fp);
+
+    // Now allocate buffer and fill it.
+    e->data = malloc(sizeof(char) * (e->size + 1));
+    if(e->data == NULL) {
+        fclose(fp);
+        return 2;
+    }
+    total = fread(e->data, sizeof(char), e->size, fp);
+    fclose(fp);
+    if(total != e->size) {
+        fprintf(stderr, "Error: Cannot open file, size doesn't match.\n");
+        free(e->data);
+        e->data = NULL;
+        return (total != e->size);
+    }
+    e->data[e->size] = 0;
+
+    // Remember what is on disk, for saving in place later.
+    if(index_stat(&file, filename) == 0 && file.size == e->size) {
+        e->disksize = file.size;
+        e->diskmtime = file.mtime;
+        e->rewrite = false;
+    }
+
+    // Cached line index means the conversions have nothing to do.
+    if(editor_loadindex(e, filename) == 0)
+        return 0;
+    size = e->size;
+    editor_convnewline(e);
+    if(e->size != size)
+        e->rewrite = true;
+    editor_startindex(e, e->size == size ? filename : NULL);
+    return 0;
+}
+/* Restore file from range backup (<filename>.rbk) of an interrupted
+ * save, returns true if the file was rolled back.
+ */
+bool editor_restore(const char *filename)
+{
+    long unsigned size, sec, nsec, ino, target, at, count;
+    struct timespec ts[2];
+    unsigned char *buf;
+    char name[512];
+    struct stat st, cur;
+    uint32_t check;
+    size_t i, n, len;
+    bool done = false;
+    int fd;
+
+    snprintf(name, sizeof(name), "%s.rbk", filename);
+    if((fd = open(name, O_RDONLY)) < 0)
+        return false;
+    if(fstat(fd, &st) != 0 || st.st_size < 8
+            || (buf = malloc(st.st_size)) == NULL) {
+        close(fd);
+        unlink(name);
+        return false;
+    }
+    len = st.st_size;
+    if(read(fd, buf, len) != (ssize_t)len)
+        len = 0;
+    close(fd);
+
+    // Torn backup means the file itself was never touched.
+    if(len >= 8)
+        memcpy(&check, buf + len - 4, 4);
+    if(len < 8 || memcmp(buf, SAVE_MAGIC, 4)
+            || check != index_checksum(INDEX_CHECKINIT, buf, len - 4)) {
+        free(buf);
+        unlink(name);
+        return false;
+    }
+    len -= 4;
+    i = 4;
+    if((n = journal_getnum(buf + i, len - i, &size)) == 0
+            || (i += n, n = journal_getnum(buf + i, len - i, &sec)) == 0
+            || (i += n, n = journal_getnum(buf + i, len - i, &nsec)) == 0
+            || (i += n, n = journal_getnum(buf + i, len - i, &ino)) == 0
+            || (i += n, n = journal_getnum(buf + i, len - i, &target)) == 0) {
+        free(buf);
+        unlink(name);
+        return false;
+    }
+    i += n;
+
+    // Only roll back the write that was interrupted. A file replaced or
+    // changed since, or one the write never got to, is left alone.
+    if(stat(filename, &cur) != 0 || cur.st_ino != ino
+            || ((long unsigned)cur.st_size != size
+            && (long unsigned)cur.st_size != target)
+            || journal_mtime(&cur) < journal_mtime(&st)) {
+        free(buf);
+        unlink(name);
+        return false;
+    }
+    if((fd = open(filename, O_WRONLY)) < 0) {
+        free(buf);
+        return false;
+    }
+
+    // Put back original bytes, length and time of the file.
+    while(i < len) {
+        if((n = journal_getnum(buf + i, len - i, &at)) == 0)
+            break;
+        i += n;
+        if((n = journal_getnum(buf + i, len - i, &count)) == 0
+                || count > len - i - n)
+            break;
+        i += n;
+        if(pwrite(fd, buf + i, count, at) != (ssize_t)count)
+            break;
+        i += count;
+    }
+    if(i == len && ftruncate(fd, size) == 0) {
+        ts[0].tv_sec = 0;
+        ts[0].tv_nsec = UTIME_OMIT;
+        ts[1].tv_sec = sec;
+        ts[1].tv_nsec = nsec;
+        futimens(fd, ts);
+        done = (fsync(fd) == 0);
+    }
+    close(fd);
+    free(buf);
+    if(done)
+        unlink(name);
+    return done;
+}
+/* Write data and add it to running checksum.
+ */
+static int editor_putbackup(FILE *fp, uint32_t *check, const void *p,
+    size_t len)
+{
+    *check = index_checksum(*check, p, len);
+    return fwrite(p, sizeof(char), len, fp) != len;
+}
+/* Copy range of file on disk in to range backup.
+ */
+static int editor_backuprange(FILE *fp, uint32_t *check, int fd,
+    long unsigned at, long unsigned count)
+{
+    unsigned char buf[4096];
+    size_t n = journal_putnum(buf, at);
+
+    n += journal_putnum(buf + n, count);
+    if(editor_putbackup(fp, check, buf, n) != 0)
+        return 1;
+    while(count > 0) {
+        ssize_t got = pread(fd, buf, count < sizeof(buf) ? count : sizeof(buf),
+            at);
+
+        if(got <= 0 || editor_putbackup(fp, check, buf, got) != 0)
+            return 2;
+        at += got;
+        count -= got;
+    }
+    return 0;
+}
+/* Write part of buffer to file at given offset.
+ */
+static int editor_writerange(editor_t *e, int fd, long unsigned at,
+    long unsigned end)
+{
+    while(at < end) {
+        ssize_t n = pwrite(fd, &e->data[at], end - at, at);
+
+        if(n <= 0)
+            return 1;
+        at += n;
+    }
+    return 0;
+}
+/* Save only the changed ranges of a file, backing up the bytes they
+ * overwrite first. Returns -1 when a full save should be done instead.
+ */
+static int editor_saveinplace(editor_t *e, const char *filename,
+    long unsigned *written)
+{
+    unsigned char head[32];
+    long unsigned tail = e->size, total = 0, disk;
+    index_head_t file;
+    char name[512];
+    uint32_t check = INDEX_CHECKINIT;
+    size_t len;
+    long i, n, delta = 0;
+    FILE *fp;
+    int fd;
+
+    if(e->rewrite || index_stat(&file, filename) != 0)
+        return -1;
+    for(i = 0; i < e->nextents; i++)
+        delta += e->extents[i].delta;
+    disk = e->size - delta;
+    if(file.size != e->disksize || file.mtime != e->diskmtime
+            || file.size != disk)
+        return -1;
+
+    // Extents before the first length change are overwritten in place,
+    // from there on the rest of the file has moved.
+    for(n = 0; n < e->nextents; n++) {
+        if(e->extents[n].delta != 0) {
+            tail = e->extents[n].start;
+            break;
+        }
+        total += e->extents[n].end - e->extents[n].start;
+    }
+    total += e->size - tail;
+    if(total * SAVE_MAXDIRTY > e->size)
+        return -1;
+    if((fd = open(filename, O_RDWR)) < 0)
+        return -1;
+
+    // Back up everything about to be overwritten.
+    snprintf(name, sizeof(name), "%s.rbk", filename);
+    if((fp = fopen(name, "wb")) == NULL) {
+        close(fd);
+        return -1;
+    }
+    memcpy(head, SAVE_MAGIC, 4);
+    len = 4;
+    len += journal_putnum(head + len, disk);
+    len += journal_putnum(head + len, file.mtime / 1000000000u);
+    len += journal_putnum(head + len, file.mtime % 1000000000u);
+    len += journal_putnum(head + len, file.ino);
+    len += journal_putnum(head + len, e->size);
+    if(editor_putbackup(fp, &check, head, len) != 0) {
+        fclose(fp);
+        close(fd);
+        remove(name);
+        return -1;
+    }
+    for(i = 0; i < n; i++) {
+        if(editor_backuprange(fp, &check, fd, e->extents[i].start,
+                e->extents[i].end - e->extents[i].start) != 0)
+            break;
+    }
+    if(i < n || (tail < disk
+            && editor_backuprange(fp, &check, fd, tail, disk - tail) != 0)
+            || fwrite(&check, sizeof(check), 1, fp) != 1
+            || fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+        fclose(fp);
+        close(fd);
+        remove(name);
+        return -1;
+    }
+    fclose(fp);
+
+    // Now overwrite the changed ranges and the moved tail.
+    for(i = 0; i < n; i++) {
+        if(editor_writerange(e, fd, e->extents[i].start,
+                e->extents[i].end) != 0)
+            break;
+    }
+    if(i < n || editor_writerange(e, fd, tail, e->size) != 0
+            || ftruncate(fd, e->size) != 0 || fsync(fd) != 0) {
+        // Backup stays behind, file is restored on next start.
+        close(fd);
+        return 8;
+    }
+    close(fd);
+    unlink(name);
+    *written = total;
+    return 0;
+}
+/* Create backup of a file (<filename>.bak), a copy if the file is to be
+ * written in place.
+ */
+static int editor_backup(const char *filename, bool copy)
+{
+    char fname[512];
+    long unsigned total, size;
+    char *buf;
+    FILE *fp;
+
+    // Hard link is enough, as the new file is written under a new name.
+    snprintf(fname, sizeof(fname), "%s.bak", filename);
+    unlink(fname);
+    if(!copy && link(filename, fname) == 0)
+        return 0;
+
+    // Open existing file and create backup.
+    if((fp = fopen(filename, "rb")) != NULL) {
+        fseek(fp, 0, SEEK_END);
+        size = ftell(fp);
+        rewind(fp);
+        buf = malloc(sizeof(char) * (size + 1));
+        if(buf == NULL) {
+            fclose(fp);
+            return 1;
+        }
+        total = fread(buf, sizeof(char), size, fp);
+        fclose(fp);
+        if(total != size) {
+            free(buf);
+            return 2;
+        }
+        if((fp = fopen(fname, "wb")) == NULL) {
+            free(buf);
+            return 3;
+        }
+        total = fwrite(buf, sizeof(char), size, fp);
+        fclose(fp);
+        free(buf);
+        if(total != size)
+            return 4;
+        // Backup created successfully.
+    } else {
+        // No original file or cannot be opened.
+    }
+    return 0;
+}
+/* Save whole file under a temporary name and move it over the original.
+ * Symbolic links are followed, so the file they point to is replaced.
+ * A file with other hard links is written in place instead, so they all
+ * keep seeing it.
+ */
+static int editor_savefull(editor_t *e, const char *filename)
+{
+    char tmp[512], *path;
+    long unsigned total;
+    struct stat st;
+    mode_t mask;
+    bool exists;
+    FILE *fp;
+    int err = 0, fd;
+
+    exists = (stat(filename, &st) == 0);
+    if(!exists || (path = realpath(filename, NULL)) == NULL)
+        path = strdup(filename);
+    if(path == NULL)
+        return 5;
+    filename = path;
+    if(exists && (err = editor_backup(filename, st.st_nlink > 1)) != 0) {
+        free(path);
+        return err;
+    }
+
+    // Now finally save the new file, under a name nobody else uses.
+    if(exists && st.st_nlink > 1) {
+        fd = open(filename, O_WRONLY | O_TRUNC);
+        tmp[0] = '\0';
+    }
+    else {
+        snprintf(tmp, sizeof(tmp), "%s.XXXXXX", filename);
+        fd = mkstemp(tmp);
+    }
+    if(fd < 0) {
+        free(path);
+        return 5;
+    }
+    if((fp = fdopen(fd, "wb")) == NULL) {
+        close(fd);
+        if(tmp[0] != '\0')
+            remove(tmp);
+        free(path);
+        return 5;
+    }
+    if(!exists) {
+        mask = umask(0);
+        umask(mask);
+        st.st_mode = 0666 & ~mask;
+    }
+    if(tmp[0] != '\0')
+        fchmod(fd, st.st_mode & 07777);
+    total = fwrite(e->data, sizeof(char), e->size, fp);
+    if(fflush(fp) != 0 || fsync(fileno(fp)) != 0)
+        total = 0;
+    fclose(fp);
+    if(tmp[0] == '\0')
+        err = total != e->size ? 6 : 0;
+    else if(total != e->size || rename(tmp, filename) != 0) {
+        remove(tmp);
+        err = 6;
+    }
+    free(path);
+    return err;
+}
+/* Save a file from the editor, in place when only a small part of it
+ * changed, else in full (also creating a backup). Number of bytes
+ * actually written is stored in written.
+ */
+int editor_save(editor_t *e, const char *filename, long unsigned *written)
+{
+    index_head_t file;
+    char name[512];
+    int err;
+
+    if((err = editor_saveinplace(e, filename, written)) < 0) {
+        err = editor_savefull(e, filename);
+        *written = e->size;
+    }
+    if(err != 0)
+        return err;
+
+    // Range backup of an earlier failed save must not roll this one back.
+    snprintf(name, sizeof(name), "%s.rbk", filename);
+    unlink(name);
+
+    // File on disk now matches the buffer.
+    e->nextents = 0;
+    e->rewrite = false;
+    e->modified = false;
+    if(index_stat(&file, filename) == 0) {
+        e->disksize = file.size;
+        e->diskmtime = file.mtime;
+    }
+    return 0;
+}
+/* Create a blank buffer for editor (new file).
+ */
+int editor_create(editor_t *e)
+{
+    // Free and initialise editor.
+    editor_free(e);
+    *e = editor_init();
+
+    // Create new buffer.
+    e->data = calloc(e->size + 1, sizeof(char));
+    if(e->data == NULL) {
+        return 1;
+    }
+    editor_getlinecount(e);
+    return 0;
+}
+/* Delete a character from the editor buffer.
+ */
+void editor_delchr(editor_t *e, long unsigned at)
+{
+    long line;
+
+    if(at >= e->size) return;
+    line = editor_getline(e, at);
+    journal_record(&e->jnl, JOURNAL_DEL, at, 1);
+    e->modified = true;
+    editor_dropcols(e, line, e->data[at] == '\n');
+    editor_markdel(e, at);
+    editor_linedel(e, at);
+    memmove(&e->data[at], &e->data[at + 1], e->size-at);
+    e->size--;
+    editor_hlchange(e, line);
+    editor_wrapchange(e, line);
+}
+/* Insert a character into the editor buffer.
+ */
+static void _editor_inschr(editor_t *e, long unsigned at, char ch)
+{
+    long line;
+
+    if(at > e->size) at = e->size;
+    line = editor_getline(e, at);
+    journal_record(&e->jnl, JOURNAL_INS, at, (unsigned char)ch);
+    e->modified = true;
+    editor_dropcols(e, line, ch == '\n');
+    e->data = realloc(e->data, sizeof(char) * (e->size + 2));
+    memmove(&e->data[at + 1], &e->data[at], e->size-at+1);
+    e->data[at] = ch;
+    e->size++;
+    editor_markins(e, at);
+    editor_lineins(e, at, ch);
+    editor_hlchange(e, line);
+    editor_wrapchange(e, line);
+    if(ch == '\n')
+        editor_wrapchange(e, line + 1);
+}
+/* Insert a character into the editor buffer with automatic new line.
+ */
+void editor_inschr(editor_t *e, long unsigned at, char ch)
+{
+    long line = editor_curline(e);
+    long unsigned startx = editor_getoffset(e, line);
+    long unsigned endx = editor_getoffset(e, line + 1);
+
+    if(e->linecount == 0 || (endx - startx) == 0) {
+        _editor_inschr(e, at, '\n');
+    }
+    _editor_inschr(e, at, ch);
+}
+/* Delete given number of bytes from the buffer, as a single edit.
+ */
+void editor_delchars(editor_t *e, long unsigned at, long unsigned count)
+{
+    if(count == 0) return;
+    journal_record(&e->jnl, JOURNAL_DEL, at, count);
+    e->jnl.hold++;
+    while(count-- > 0) {
+        editor_delchr(e, at);
+    }
+    e->jnl.hold--;
+}
+/* Delete a line of text from the buffer.
+ */
+void editor_deleteline(editor_t *e, long line)
+{
+    long unsigned startx = editor_getoffset(e, line);
+    long unsigned endx = editor_getoffset(e, line + 1);
+
+    editor_delchars(e, startx, endx - startx);
+}
+/* Replay swap file of given file against the buffer, return edits applied
+ * (-1 if there is no journal for this version of the file).
+ */
+long editor_replay(editor_t *e, const char *filename)
+{
+    long unsigned size, mtime, at, arg;
+    unsigned char *buf;
+    char name[512];
+    struct stat st;
+    size_t i, n, len, valid;
+    long nops = 0;
+    int fd;
+
+    journal_name(name, sizeof(name), filename);
+    if((fd = open(name, O_RDWR)) < 0)
+        return -1;
+    editor_waitindex(e);
+    if(fstat(fd, &st) != 0 || st.st_size < 4) {
+        close(fd);
+        return -1;
+    }
+    len = st.st_size;
+    if((buf = malloc(len)) == NULL) {
+        close(fd);
+        return -1;
+    }
+    if(read(fd, buf, len) != (ssize_t)len || memcmp(buf, JOURNAL_MAGIC, 4)) {
+        free(buf);
+        close(fd);
+        return -1;
+    }
+
+    // Check journal was made against the file on disk.
+    i = 4;
+    if((n = journal_getnum(buf + i, len - i, &size)) == 0
+            || (i += n, n = journal_getnum(buf + i, len - i, &mtime)) == 0) {
+        free(buf);
+        close(fd);
+        return -1;
+    }
+    i += n;
+    if(stat(filename, &st) != 0)
+        memset(&st, 0, sizeof(st));
+    if(size != (long unsigned)st.st_size || mtime != journal_mtime(&st)) {
+        free(buf);
+        close(fd);
+        return -1;
+    }
+
+    // Apply each complete record, a torn tail is dropped.
+    e->jnl.hold++;
+    for(valid = i; i < len; valid = i) {
+        int op = buf[i++];
 
-    if(p == NULL) {
-        e->find = 0;
-        p = strstr(&e->data[e->find], query);
+        if((n = journal_getnum(buf + i, len - i, &at)) == 0)
+            break;
+        i += n;
+        if(op == JOURNAL_INS) {
+            if(i >= len)
+                break;
+            arg = buf[i++];
+        }
+        else if(op == JOURNAL_DEL) {
+            if((n = journal_getnum(buf + i, len - i, &arg)) == 0)
+                break;
+            i += n;
+        }
+        else {
+            break;
+        }
+
+        if(op == JOURNAL_INS) {
+            _editor_inschr(e, at, arg);
+        }
+        else {
+            while(arg-- > 0)
+                editor_delchr(e, at);
+        }
+        nops++;
     }
+    e->jnl.hold--;
 
-    if(p != NULL) {
-        long unsigned offset = p - e->data;
-        long lines = editor_getline(e, offset);
-        long unsigned offset2;
+    // Cut off torn tail so new records append cleanly.
+    if(ftruncate(fd, valid) != 0)
+        nops = -1;
+    free(buf);
+    close(fd);
+    return nops;
+}
+/* Clear a line on the screen.
+ */
+void editor_clearline(editor_t *e, long line, long col)
+{
+    register long i;
+
+    if(line < 0 || line > e->rows - 1) return;
+    if(col < 0 || col > e->cols - 1) return;
+
+    for(i = col; i < e->cols; i++) {
+        mvaddch(line, i, ' ');
+    }
+}
+/* Render a line of text on the screen, expanding tabs and decoding UTF-8.
+ * When wrapping each screen row shows the next part of a long line.
+ */
+void editor_renderline(editor_t *e, long line)
+{
+    long num = line + e->skiprows, skip = e->skipcols, sub;
+    long unsigned startx, size, i, end, width, from = 0;
+    unsigned char *hl = NULL;
+    long col;
+    chtype attr;
 
-        // Calculate cursor position in buffer.
-        if(lines >= (e->rows - 2)) {
-            e->skiprows = lines - (e->rows - 2);
+    if(line < 0 || line > e->rows - 1) return;
+    if(editor_wrapping(e)) {
+        if(num >= editor_rowcount(e)) {
+            // Text after the last new line has no rows of its own, it is
+            // drawn once past the last row and the rows below stay blank.
+            skip = (num - editor_rowcount(e)) * e->cols;
+            num = e->linecount;
+            if(skip > 0 && (long unsigned)skip >= editor_bytetocol(e, num,
+                    editor_linelen(e, num)))
+                num++;
         }
         else {
-            e->skiprows = 0;
+            num = editor_wrapline(e, num, &sub);
+            skip = sub * e->cols;
         }
-        e->cy = lines - e->skiprows;
-        offset2 = editor_getoffset(e, e->cy + e->skiprows);
-        e->skipcols = (long)(offset - offset2) >= e->cols ? ((offset - offset2) - (e->cols - 1)) + strlen(query) : 0;
-        e->cx = (long)(offset - offset2) >= e->cols ? ((offset - offset2) - e->skipcols) % e->cols : (offset - offset2);
-        e->find = offset + strlen(query);
     }
+    startx = editor_getoffset(e, num);
+    size = editor_linelen(e, num);
+    i = editor_coltobyte(e, num, skip);
+    col = (long)editor_bytetocol(e, num, i) - skip;
+
+    // Lex from start of line, keeping classes of the part on screen. Rows
+    // of a wrapped line share one lex.
+    end = editor_nextchar(e, num, editor_coltobyte(e, num, skip + e->cols));
+    if(e->syntax != NULL && has_colors() && i < size
+            && (e->hlline != num || i < e->hlfrom || end > e->hlupto)) {
+        long unsigned upto = end;
+
+        if(e->wrap.on)
+            upto = editor_nextchar(e, num, editor_coltobyte(e, num,
+                skip + (long unsigned)e->cols * (e->rows - 1 - line)));
+        if(e->hlbufcap < (long)(upto - i)) {
+            unsigned char *buf = realloc(e->hlbuf, upto - i);
+            if(buf != NULL) {
+                e->hlbuf = buf;
+                e->hlbufcap = upto - i;
+            }
+        }
+        e->hlline = -1;
+        if(e->hlbufcap >= (long)(upto - i)) {
+            syntax_lex(e->syntax, e->data + startx, size,
+                editor_hlstate(e, num), e->hlbuf, i, upto);
+            e->hlline = num;
+            e->hlfrom = i;
+            e->hlupto = upto;
+        }
+    }
+    if(e->syntax != NULL && e->hlline == num) {
+        hl = e->hlbuf;
+        from = e->hlfrom;
+    }
+
+    if(has_colors())
+        attron(COLOR_PAIR(EDITOR_PAIR));
+
+    editor_clearline(e, line, 0);
+    while(i < size && col < e->cols) {
+        const char *p = e->data + startx + i;
+        size_t n = editor_char(e, p, size - i, col + skip, &width);
+        uint32_t cp;
+
+        if(hl != NULL && i < e->hlupto && hl[i - from] != HL_NORMAL)
+            attr = COLOR_PAIR(SYNTAX_PAIR + hl[i - from] - 1);
+        else
+            attr = 0;
+
+        // Line is already cleared, so tabs only move the column.
+        if(*p == '\t') {
+            col += width;
+            i += n;
+            continue;
+        }
+        if(col < 0 || col + (long)width > e->cols) {
+            // Wide character cut off at the edge of the screen.
+            mvaddch(line, col < 0 ? 0 : col, (col < 0 ? '<' : '>') | attr);
+        }
+        else if((unsigned char)*p < 0x80 && n == 1) {
+            mvaddch(line, col, (unsigned char)*p | attr);
+        }
+        else if(utf8_decode(p, n, &cp) > 0 && wcwidth(cp) > 0) {
+            if(attr != 0)
+                attron(attr);
+            mvaddnstr(line, col, p, n);
+            if(attr != 0)
+                attron(COLOR_PAIR(EDITOR_PAIR));
+        }
+        else {
+            mvaddch(line, col, '?' | attr);
+        }
+        col += width;
+        i += n;
+    }
+
+    if(has_colors())
+        attroff(COLOR_PAIR(EDITOR_PAIR));
 }
-/* Open a file with the editor.
+/* Render text buffer from editor.
  */
-int editor_open(editor_t *e, const char *filename)
+void editor_render(editor_t *e)
 {
-    long unsigned total;
-    FILE *fp;
+    int y;
 
-    // Try to open file.
-    if((fp = fopen(filename, "rb")) == NULL)
-        return 1;
+    // Buffer may have changed since last time, lex again.
+    e->hlline = -1;
 
-    // File is open so get length.
-    fseek(fp, 0, SEEK_END);
-    e->size = ftell(fp);
-    rewind(fp);
+    // Display the text on the screen from the editor buffer.
+    for(y = 0; y < e->rows - 1; y++) {
+        // Render line of text to screen.
+        editor_renderline(e, y);
+    }
+}
+/* Set status message for editor.
+ */
+void editor_setstatus(editor_t *e, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(e->status, sizeof(e->status), fmt, ap);
+    va_end(ap);
+}
+/* Render status message on screen.
+ */
+void editor_renderstatus(editor_t *e)
+{
+    if(has_colors())
+        attron(COLOR_PAIR(STATUS_PAIR));
+    editor_clearline(e, e->rows - 1, 0);
+    mvprintw(e->rows - 1, 0, "%s", e->status);
+    if(has_colors())
+        attroff(COLOR_PAIR(STATUS_PAIR));
+}
 
-    // Now allocate buffer and fill it.
-    e->data = malloc(sizeof(char) * (e->size + 1));
-    if(e->data == NULL) {
-        fclose(fp);
+/* ---------------------------- Buffer Stuff ------------------------- */
+
+#define BUFFER_MAX 16
+#define BUFFER_BUDGET 32
+
+typedef struct buffer {
+    editor_t e;
+    bool loaded;
+    long unsigned used;
+    long unsigned spillat;
+    long unsigned spillsize;
+    long line;
+    long unsigned byte;
+} buffer_t;
+
+typedef struct buffers {
+    buffer_t list[BUFFER_MAX];
+    int count, cur;
+    long unsigned budget;
+    long unsigned clock;
+    int spillfd;
+} buffers_t;
+
+/* Initialise buffer list with the editor already open as first buffer,
+ * all buffers share given memory budget in megabytes. Its slot is only
+ * filled when parked, its line index may still be built meanwhile.
+ */
+void buffer_init(buffers_t *b, long budget)
+{
+    b->count = 1;
+    b->cur = 0;
+    b->budget = (budget > 0 ? budget : BUFFER_BUDGET) * 1024L * 1024L;
+    b->clock = 0;
+    b->spillfd = -1;
+    b->list[0].e = editor_init();
+    b->list[0].loaded = true;
+    b->list[0].spillsize = 0;
+}
+/* Find room in the spill file for given number of bytes, first fit
+ * between what other buffers spilled.
+ */
+static long unsigned buffer_spillfit(buffers_t *b, long unsigned size)
+{
+    long unsigned at = 0;
+    bool moved;
+    int i;
+
+    do {
+        moved = false;
+        for(i = 0; i < b->count; i++) {
+            buffer_t *f = &b->list[i];
+
+            if(f->spillsize > 0 && at < f->spillat + f->spillsize
+                    && f->spillat < at + size) {
+                at = f->spillat + f->spillsize;
+                moved = true;
+            }
+        }
+    } while(moved);
+    return at;
+}
+/* Write contents of a modified buffer and its line index to the spill
+ * file, created on first use and unlinked straight away.
+ */
+static int buffer_spill(buffers_t *b, buffer_t *f)
+{
+    editor_t *e = &f->e;
+    long unsigned lines = sizeof(long unsigned) * (e->linecount + 1);
+    const char *dir = getenv("TMPDIR");
+    char name[512];
+
+    if(b->spillfd < 0) {
+        snprintf(name, sizeof(name), "%s/psedit-XXXXXX",
+            dir != NULL && dir[0] != '\0' ? dir : "/tmp");
+        if((b->spillfd = mkstemp(name)) < 0)
+            return 1;
+        unlink(name);
+    }
+    f->spillat = buffer_spillfit(b, e->size + lines);
+    if(pwrite(b->spillfd, e->data, e->size, f->spillat)
+            != (ssize_t)e->size
+            || pwrite(b->spillfd, e->lines, lines, f->spillat + e->size)
+            != (ssize_t)lines)
         return 2;
+    f->spillsize = e->size + lines;
+    return 0;
+}
+/* Drop contents of a buffer that is not current. Unmodified buffers are
+ * read from their file again, modified ones go to the spill file.
+ */
+static int buffer_unload(buffers_t *b, buffer_t *f)
+{
+    editor_t *e = &f->e;
+
+    editor_waitindex(e);
+    if(e->modified) {
+        if(buffer_spill(b, f) != 0)
+            return 1;
     }
-    total = fread(e->data, sizeof(char), e->size, fp);
-    fclose(fp);
-    if(total != e->size) {
-        fprintf(stderr, "Error: Cannot open file, size doesn't match.\n");
-        free(e->data);
-        return (total != e->size);
+    else {
+        // Nothing to recover, journal starts again on reload.
+        f->line = editor_curline(e);
+        f->byte = editor_cursor(e);
+        journal_close(&e->jnl, e->filename, true);
     }
-    e->data[e->size] = 0;
+    editor_unload(e);
+    f->loaded = false;
     return 0;
 }
-/* Save a file from the editor (also creating a backup).
+/* Bring contents of a buffer back in to the current editor.
  */
-int editor_save(editor_t *e, const char *filename)
+static int buffer_load(buffers_t *b, buffer_t *f, editor_t *e)
 {
-    char fname[512];
-    long unsigned total, size;
-    char *buf;
-    FILE *fp;
+    long unsigned lines = sizeof(long unsigned) * (e->linecount + 1);
+    long unsigned len;
+    long line;
+    int i;
 
-    // Open existing file and create backup.
-    if((fp = fopen(filename, "rb")) != NULL) {
-        fseek(fp, 0, SEEK_END);
-        size = ftell(fp);
-        rewind(fp);
-        snprintf(fname, sizeof(fname), "%s.bak", filename);
-        buf = malloc(sizeof(char) * (size + 1));
-        if(buf == NULL) {
-            fclose(fp);
+    if(f->loaded) return 0;
+
+    // Modified buffer pages back in from the spill file.
+    if(f->spillsize > 0) {
+        if((e->data = malloc(e->size + 1)) == NULL
+                || (e->lines = malloc(lines)) == NULL
+                || pread(b->spillfd, e->data, e->size, f->spillat)
+                != (ssize_t)e->size
+                || pread(b->spillfd, e->lines, lines, f->spillat + e->size)
+                != (ssize_t)lines) {
+            editor_unload(e);
             return 1;
         }
-        total = fread(buf, sizeof(char), size, fp);
-        fclose(fp);
-        if(total != size) {
-            free(buf);
+        e->data[e->size] = 0;
+        e->linecap = e->linecount + 1;
+        f->spillsize = 0;
+
+        // Hand disk space back once nothing is spilled.
+        for(i = 0; i < b->count && b->list[i].spillsize == 0; i++);
+        if(i == b->count)
+            ftruncate(b->spillfd, 0);
+        return 0;
+    }
+
+    // Unmodified buffer is read again, the file may have changed since.
+    e->rewrite = true;
+    e->disksize = 0;
+    e->diskmtime = 0;
+    e->nextents = 0;
+    if(editor_open(e, e->filename) != 0) {
+        if((e->data = calloc(1, sizeof(char))) == NULL)
             return 2;
+        e->size = 0;
+        editor_getlinecount(e);
+    }
+    journal_open(&e->jnl, e->filename, false);
+    editor_waitindex(e);
+    line = f->line < e->linecount ? f->line : e->linecount - 1;
+    line = line < 0 ? 0 : line;
+    len = editor_linelen(e, line);
+    editor_moveto(e, line, f->byte < len ? f->byte : len);
+    return 0;
+}
+/* Drop least recently used buffers until all of them fit the memory
+ * budget, the current buffer always stays.
+ */
+static void buffer_trim(buffers_t *b, editor_t *e)
+{
+    long unsigned total = editor_memory(e), size;
+    buffer_t *lru;
+    int i;
+
+    for(i = 0; i < b->count; i++) {
+        if(i != b->cur && b->list[i].loaded)
+            total += editor_memory(&b->list[i].e);
+    }
+    while(total > b->budget) {
+        lru = NULL;
+        for(i = 0; i < b->count; i++) {
+            buffer_t *f = &b->list[i];
+
+            if(i != b->cur && f->loaded
+                    && (lru == NULL || f->used < lru->used))
+                lru = f;
         }
-        if((fp = fopen(fname, "wb")) == NULL) {
-            free(buf);
-            return 3;
+        size = lru != NULL ? editor_memory(&lru->e) : 0;
+        if(lru == NULL || buffer_unload(b, lru) != 0)
+            break;
+        total -= size;
+    }
+}
+/* Put the current editor back in its buffer.
+ */
+static void buffer_park(buffers_t *b, editor_t *e)
+{
+    buffer_t *f = &b->list[b->cur];
+
+    editor_waitindex(e);
+    journal_sync(&e->jnl);
+    f->e = *e;
+    f->loaded = true;
+    f->used = ++b->clock;
+}
+/* Make given buffer current, returns 0 on success.
+ */
+int buffer_switch(buffers_t *b, editor_t *e, int to)
+{
+    int rows = e->rows, cols = e->cols;
+
+    if(to == b->cur || to < 0 || to >= b->count)
+        return to == b->cur ? 0 : 1;
+    buffer_park(b, e);
+    *e = b->list[to].e;
+    if(buffer_load(b, &b->list[to], e) != 0) {
+        *e = b->list[b->cur].e;
+        return 1;
+    }
+    b->list[to].loaded = true;
+    b->cur = to;
+
+    // Screen may have changed size while it was away.
+    if(rows != e->rows || cols != e->cols)
+        editor_layout(e, e->wrap.on, e->tabstop, rows, cols);
+    e->dirty = true;
+    buffer_trim(b, e);
+    return 0;
+}
+/* Open a file in a new buffer and make it current, switching to its
+ * buffer instead when already open. Returns 0 on success.
+ */
+int buffer_open(buffers_t *b, editor_t *e, const char *filename)
+{
+    int rows = e->rows, cols = e->cols, tabstop = e->tabstop;
+    bool wrap = e->wrap.on, restored;
+    struct stat st, cur;
+    long recovered;
+    int i;
+
+    for(i = 0; i < b->count; i++) {
+        const char *name = i == b->cur ? e->filename : b->list[i].e.filename;
+
+        if(strcmp(name, filename) == 0 || (stat(filename, &st) == 0
+                && stat(name, &cur) == 0 && st.st_dev == cur.st_dev
+                && st.st_ino == cur.st_ino))
+            return buffer_switch(b, e, i);
+    }
+    if(b->count == BUFFER_MAX)
+        return 1;
+
+    // New buffer is built in place of the parked one.
+    buffer_park(b, e);
+    restored = editor_restore(filename);
+    *e = editor_init();
+    if(editor_open(e, filename) != 0 && editor_create(e) != 0) {
+        editor_free(e);
+        *e = b->list[b->cur].e;
+        return 2;
+    }
+    e->rows = rows;
+    e->cols = cols;
+    e->tabstop = tabstop;
+    e->wrap.on = wrap;
+    e->syntax = syntax_find(filename);
+    snprintf(e->filename, sizeof(e->filename), "%s", filename);
+
+    // Recover unsaved edits and keep journaling from there.
+    recovered = editor_replay(e, filename);
+    if(journal_open(&e->jnl, filename, recovered >= 0) != 0)
+        editor_setstatus(e, "Warning: Could not create swap file.");
+    else if(restored)
+        editor_setstatus(e, "Warning: Restored %s from interrupted save.",
+            filename);
+    else if(recovered > 0)
+        editor_setstatus(e, "Recovered %ld edits from %s.swp",
+            recovered, filename);
+    else
+        editor_setstatus(e, "Opened %s.", filename);
+    e->status_on = true;
+
+    b->cur = b->count++;
+    b->list[b->cur].loaded = true;
+    b->list[b->cur].spillsize = 0;
+    buffer_trim(b, e);
+    return 0;
+}
+/* Close the current buffer and make the next one current, the last
+ * buffer cannot be closed.
+ */
+int buffer_close(buffers_t *b, editor_t *e)
+{
+    int to = b->cur + 1 < b->count ? b->cur + 1 : b->cur - 1;
+    int rows = e->rows, cols = e->cols;
+    editor_t next;
+
+    if(b->count == 1)
+        return 1;
+
+    // Load next buffer first, so a failure leaves things as they were.
+    next = b->list[to].e;
+    if(buffer_load(b, &b->list[to], &next) != 0)
+        return 2;
+    journal_close(&e->jnl, e->filename, true);
+    editor_free(e);
+    *e = next;
+    b->list[to].loaded = true;
+
+    memmove(&b->list[b->cur], &b->list[b->cur + 1],
+        sizeof(buffer_t) * (b->count - b->cur - 1));
+    b->count--;
+    b->cur = to > b->cur ? b->cur : to;
+    if(rows != e->rows || cols != e->cols)
+        editor_layout(e, e->wrap.on, e->tabstop, rows, cols);
+    e->dirty = true;
+    return 0;
+}
+/* Close every buffer, current one included.
+ */
+void buffer_free(buffers_t *b, editor_t *e)
+{
+    int i;
+
+    for(i = 0; i < b->count; i++) {
+        editor_t *f = i == b->cur ? e : &b->list[i].e;
+
+        journal_close(&f->jnl, f->filename, true);
+        editor_free(f);
+    }
+    if(b->spillfd >= 0)
+        close(b->spillfd);
+    b->count = 0;
+    b->spillfd = -1;
+}
+
+/* ---------------------------- Grep Stuff ------------------------- */
+
+#define GREP_MAXTHREADS 8
+#define GREP_BUFSIZE (64L * 1024L)
+#define GREP_MAXRESULTS 100000
+#define GREP_TEXTLEN 160
+#define GREP_REFRESHMS 100
+
+typedef struct grep_task {
+    char *path;
+    bool dir;
+} grep_task_t;
+
+typedef struct grep_result {
+    char *path;
+    bool owner;
+    long line;
+    long unsigned col;
+    char text[GREP_TEXTLEN];
+} grep_result_t;
+
+struct grep;
+
+typedef struct grep_worker {
+    struct grep *g;
+    int id;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    grep_task_t *tasks;
+    long head, tail, cap;
+    char *buf;
+} grep_worker_t;
+
+typedef struct grep {
+    atomic_bool stop;
+    bool shown;
+    char query[80];
+    size_t qlen;
+    int nthreads, nstarted;
+    grep_worker_t workers[GREP_MAXTHREADS];
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    long queued, pending;
+    long nfiles;
+    grep_result_t *results;
+    long count, cap;
+    long sel, skip;
+} grep_t;
+
+/* Initialise the grep structure (no search running).
+ */
+void grep_init(grep_t *g)
+{
+    memset(g, 0, sizeof(grep_t));
+    atomic_init(&g->stop, false);
+    pthread_mutex_init(&g->lock, NULL);
+    pthread_cond_init(&g->work, NULL);
+}
+/* Queue a task on a worker, the worker owns path from now on.
+ */
+static void grep_push(grep_worker_t *w, char *path, bool dir)
+{
+    grep_t *g = w->g;
+
+    pthread_mutex_lock(&w->lock);
+    if(w->tail == w->cap && w->head > 0) {
+        memmove(w->tasks, &w->tasks[w->head],
+            sizeof(grep_task_t) * (w->tail - w->head));
+        w->tail -= w->head;
+        w->head = 0;
+    }
+    if(w->tail == w->cap) {
+        long cap = w->cap > 0 ? w->cap * 2 : 64;
+        grep_task_t *tasks = realloc(w->tasks, sizeof(grep_task_t) * cap);
+
+        if(tasks == NULL) {
+            pthread_mutex_unlock(&w->lock);
+            free(path);
+            return;
         }
-        total = fwrite(buf, sizeof(char), size, fp);
-        fclose(fp);
-        free(buf);
-        if(total != size)
-            return 4;
-        // Backup created successfully.
-    } else {
-        // No original file or cannot be opened.
+        w->tasks = tasks;
+        w->cap = cap;
+    }
+    w->tasks[w->tail].path = path;
+    w->tasks[w->tail++].dir = dir;
+    pthread_mutex_unlock(&w->lock);
+
+    pthread_mutex_lock(&g->lock);
+    g->queued++;
+    g->pending++;
+    pthread_cond_signal(&g->work);
+    pthread_mutex_unlock(&g->lock);
+}
+/* Take a task from a worker, the newest for its owner and the oldest
+ * when stolen by another.
+ */
+static bool grep_take(grep_worker_t *w, grep_task_t *t, bool steal)
+{
+    grep_t *g = w->g;
+
+    pthread_mutex_lock(&w->lock);
+    if(w->head == w->tail) {
+        pthread_mutex_unlock(&w->lock);
+        return false;
+    }
+    *t = steal ? w->tasks[w->head++] : w->tasks[--w->tail];
+    if(w->head == w->tail)
+        w->head = w->tail = 0;
+    pthread_mutex_unlock(&w->lock);
+
+    pthread_mutex_lock(&g->lock);
+    g->queued--;
+    pthread_mutex_unlock(&g->lock);
+    return true;
+}
+/* Add a matching line to the results, the first result of a file takes
+ * over its path (own is cleared then).
+ */
+static void grep_add(grep_t *g, char **own, const char *path, long line,
+    long unsigned col, const char *text, size_t len)
+{
+    grep_result_t *r;
+    size_t i;
+
+    pthread_mutex_lock(&g->lock);
+    if(g->count == g->cap && g->count < GREP_MAXRESULTS) {
+        long cap = g->cap > 0 ? g->cap * 2 : 256;
+
+        if(cap > GREP_MAXRESULTS)
+            cap = GREP_MAXRESULTS;
+        grep_result_t *results = realloc(g->results,
+            sizeof(grep_result_t) * cap);
+
+        if(results != NULL) {
+            g->results = results;
+            g->cap = cap;
+        }
+    }
+    if(g->count < g->cap) {
+        r = &g->results[g->count++];
+        r->owner = *own != NULL;
+        r->path = (char *)path;
+        *own = NULL;
+        r->line = line;
+        r->col = col;
+
+        // Tabs and control characters would break up the list.
+        if(len >= GREP_TEXTLEN)
+            len = GREP_TEXTLEN - 1;
+        for(i = 0; i < len; i++)
+            r->text[i] = (unsigned char)text[i] < ' ' ? ' ' : text[i];
+        r->text[len] = '\0';
     }
 
-    // Now finally save the new file.
-    if((fp = fopen(filename, "wb")) == NULL)
-        return 5;
-    total = fwrite(e->data, sizeof(char), e->size, fp);
-    fclose(fp);
-    if(total != e->size)
-        return 6;
-    // File written successfully.
-    return 0;
+    // No point searching on once the list is full.
+    if(g->count == GREP_MAXRESULTS)
+        g->stop = true;
+    pthread_mutex_unlock(&g->lock);
 }
-/* Create a blank buffer for editor (new file).
+/* Find query in a block of memory.
  */
-int editor_create(editor_t *e)
+static const char *grep_search(const char *p, size_t len, const char *q,
+    size_t qlen)
 {
-    // Free and initialise editor.
-    editor_free(e);
-    *e = editor_init();
+    const char *end = p + len;
 
-    // Create new buffer.
-    e->data = calloc(e->size + 1, sizeof(char));
-    if(e->data == NULL) {
-        return 1;
+    while(len >= qlen && (p = memchr(p, q[0], len - qlen + 1)) != NULL) {
+        if(memcmp(p, q, qlen) == 0)
+            return p;
+        p++;
+        len = end - p;
     }
-    return 0;
+    return NULL;
 }
-/* Delete a character from the editor buffer.
+/* Search a file, reading it a buffer at a time. The unfinished last line
+ * of each buffer is carried over, so lines are reported once and matches
+ * across reads are found.
  */
-void editor_delchr(editor_t *e, long unsigned at)
+static void grep_file(grep_worker_t *w, char *path)
 {
-    if(at >= e->size) return;
-    memmove(&e->data[at], &e->data[at + 1], e->size-at);
-    e->size--;
-    editor_getlinecount(e);
+    grep_t *g = w->g;
+    char *buf = w->buf, *own = path;
+    const char *p, *q;
+    size_t keep = 0, len, pos, start, half = GREP_BUFSIZE / 2;
+    size_t lineoff = 0;
+    long line = 1, last = 0;
+    bool first = true;
+    ssize_t n;
+    int fd;
+
+    if((fd = open(path, O_RDONLY)) < 0) {
+        free(own);
+        return;
+    }
+    while(!g->stop && (n = read(fd, buf + keep, GREP_BUFSIZE - keep)) > 0) {
+        len = keep + n;
+
+        // Skip binary files.
+        if(first && memchr(buf, '\0', len < 1024 ? len : 1024) != NULL)
+            break;
+        first = false;
+
+        // Count lines up to each match, start is where its line starts.
+        pos = start = 0;
+        for(p = buf; (p = grep_search(p, buf + len - p, g->query, g->qlen))
+                != NULL; ) {
+            for(q = buf + pos; (q = memchr(q, '\n', p - q)) != NULL; ) {
+                line++;
+                start = ++q - buf;
+                lineoff = 0;
+            }
+            pos = p - buf;
+
+            // Lines are reported once, even if carried over.
+            if(pos + g->qlen > keep && line != last) {
+                q = memchr(p, '\n', buf + len - p);
+                grep_add(g, &own, path, line, lineoff + pos - start,
+                    buf + start, (q != NULL ? q : buf + len) - (buf + start));
+                last = line;
+            }
+            if((p = memchr(p, '\n', buf + len - p)) == NULL)
+                break;
+        }
+        for(q = buf + pos; (q = memchr(q, '\n', buf + len - q)) != NULL; ) {
+            line++;
+            start = ++q - buf;
+            lineoff = 0;
+        }
+
+        // Carry last line over, or just enough of a long one for a match.
+        // Bytes of the line dropped are counted for the column.
+        keep = len - start;
+        if(keep > half) {
+            keep = g->qlen - 1;
+            lineoff += len - keep - start;
+        }
+        memmove(buf, buf + len - keep, keep);
+    }
+    close(fd);
+    free(own);
 }
-/* Insert a character into the editor buffer.
+/* Check if a file is a sidecar of the editor itself (swap, backup, range
+ * backup, line index or a temporary file of those).
  */
-static void _editor_inschr(editor_t *e, long unsigned at, char ch)
+static bool grep_sidecar(const char *name)
 {
-    if(at > e->size) at = e->size;
-    e->data = realloc(e->data, sizeof(char) * (e->size + 2));
-    memmove(&e->data[at + 1], &e->data[at], e->size-at+1);
-    e->data[at] = ch;
-    e->size++;
+    static const char *ext[] = { ".swp", ".bak", ".rbk", ".idx", ".tmp" };
+    size_t i, len = strlen(name);
+
+    for(i = 0; i < sizeof(ext) / sizeof(ext[0]); i++) {
+        if(len > 4 && strcmp(name + len - 4, ext[i]) == 0)
+            return true;
+    }
+    return false;
 }
-/* Insert a character into the editor buffer with automatic new line.
+/* List a directory, queueing its files and directories. Hidden entries,
+ * symbolic links and sidecars of the editor are skipped.
  */
-void editor_inschr(editor_t *e, long unsigned at, char ch)
+static void grep_dir(grep_worker_t *w, char *path)
 {
-    long unsigned startx = editor_getoffset(e, e->cy + e->skiprows);
-    long unsigned endx = editor_getoffset(e, (e->cy + e->skiprows) + 1);
+    struct dirent *d;
+    struct stat st;
+    DIR *dir;
 
-    if(e->linecount == 0 || (endx - startx) == 0) {
-        _editor_inschr(e, at, '\n');
+    if((dir = opendir(path)) == NULL) {
+        free(path);
+        return;
     }
-    _editor_inschr(e, at, ch);
-    editor_getlinecount(e);
+    while(!w->g->stop && (d = readdir(dir)) != NULL) {
+        size_t len = strlen(path) + strlen(d->d_name) + 2;
+        bool isdir, isreg;
+        char *name;
+
+        if(d->d_name[0] == '.' || (name = malloc(len)) == NULL)
+            continue;
+        if(strcmp(path, ".") == 0)
+            snprintf(name, len, "%s", d->d_name);
+        else
+            snprintf(name, len, "%s/%s", path, d->d_name);
+
+#ifdef DT_DIR
+        isdir = d->d_type == DT_DIR;
+        isreg = d->d_type == DT_REG;
+        if(d->d_type == DT_UNKNOWN)
+#endif
+        {
+            isdir = lstat(name, &st) == 0 && S_ISDIR(st.st_mode);
+            isreg = !isdir && S_ISREG(st.st_mode);
+        }
+        if(isdir || (isreg && !grep_sidecar(d->d_name)))
+            grep_push(w, name, isdir);
+        else
+            free(name);
+    }
+    closedir(dir);
+    free(path);
 }
-/* Delete a line of text from the buffer.
+/* Worker thread, runs its own tasks newest first and steals the oldest
+ * of other workers when out of work.
  */
-void editor_deleteline(editor_t *e, long line)
+static void *grep_worker(void *arg)
 {
-    long unsigned startx = editor_getoffset(e, line);
-    long unsigned endx = editor_getoffset(e, line + 1);
-    unsigned i;
+    grep_worker_t *w = arg;
+    grep_t *g = w->g;
+    grep_task_t t;
+    bool done;
+    int i;
+
+    for(;;) {
+        bool found = grep_take(w, &t, false);
+
+        for(i = 1; !found && i < g->nthreads; i++)
+            found = grep_take(&g->workers[(w->id + i) % g->nthreads], &t, true);
+        if(found) {
+            if(g->stop)
+                free(t.path);
+            else if(t.dir)
+                grep_dir(w, t.path);
+            else
+                grep_file(w, t.path);
+
+            pthread_mutex_lock(&g->lock);
+            if(!t.dir)
+                g->nfiles++;
+            if(--g->pending == 0)
+                pthread_cond_broadcast(&g->work);
+            pthread_mutex_unlock(&g->lock);
+            continue;
+        }
 
-    for(i = 0; i < (endx - startx); i++) {
-        editor_delchr(e, startx);
+        // Wait for more work, or for the last task to finish.
+        pthread_mutex_lock(&g->lock);
+        while(g->queued == 0 && g->pending > 0)
+            pthread_cond_wait(&g->work, &g->lock);
+        done = g->pending == 0;
+        pthread_mutex_unlock(&g->lock);
+        if(done)
+            break;
     }
+    return NULL;
 }
-/* Clear a line on the screen.
+/* Stop a running search and drop its results.
  */
-void editor_clearline(editor_t *e, long line, long col)
+void grep_free(grep_t *g)
 {
-    register long i;
+    long i, j;
 
-    if(line < 0 || line > e->rows - 1) return;
-    if(col < 0 || col > e->cols - 1) return;
+    // Workers steal from each other, so all must be gone first.
+    g->stop = true;
+    for(i = 0; i < g->nstarted; i++)
+        pthread_join(g->workers[i].thread, NULL);
+    for(i = 0; i < g->nthreads; i++) {
+        grep_worker_t *w = &g->workers[i];
 
-    for(i = col; i < e->cols; i++) {
-        mvaddch(line, i, ' ');
+        for(j = w->head; j < w->tail; j++)
+            free(w->tasks[j].path);
+        pthread_mutex_destroy(&w->lock);
+        free(w->tasks);
+        free(w->buf);
     }
+    for(i = 0; i < g->count; i++) {
+        if(g->results[i].owner)
+            free(g->results[i].path);
+    }
+    free(g->results);
+    pthread_mutex_destroy(&g->lock);
+    pthread_cond_destroy(&g->work);
+    grep_init(g);
 }
-/* Render a line of text on the screen.
+/* Start searching files under given directory, results come in while the
+ * editor keeps running.
  */
-void editor_renderline(editor_t *e, long line)
+int grep_start(grep_t *g, const char *dir, const char *query)
 {
-    long unsigned startx = editor_getoffset(e, line + e->skiprows);
-    long unsigned endx = editor_getoffset(e, (line + e->skiprows) + 1);
-    long size = (endx - startx) > 0 ? (endx - startx) - 1 : 0;
-    register long i;
+    char *root;
+    int i, n;
 
-    if(line < 0 || line > e->rows - 1) return;
+    grep_free(g);
+    if(query[0] == '\0' || (root = strdup(dir)) == NULL)
+        return 1;
+    snprintf(g->query, sizeof(g->query), "%s", query);
+    g->qlen = strlen(g->query);
 
-    if(has_colors())
-        attron(COLOR_PAIR(EDITOR_PAIR));
+    // Every worker gets its own queue and read buffer.
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+    n = n < 1 ? 1 : n > GREP_MAXTHREADS ? GREP_MAXTHREADS : n;
+    for(i = 0; i < n; i++) {
+        grep_worker_t *w = &g->workers[i];
 
-    editor_clearline(e, line, 0);
-    for(i = 0; i < size; i++) {
-        if((!isprint(e->data[startx + i]) && !iscntrl(e->data[startx + i]))
-                || (e->data[startx + i] == '\t'))
-            mvaddch(line, i - e->skipcols, ' ');
-        else
-            mvaddch(line, i - e->skipcols, e->data[startx + i]);
+        if((w->buf = malloc(GREP_BUFSIZE)) == NULL)
+            break;
+        w->g = g;
+        w->id = i;
+        pthread_mutex_init(&w->lock, NULL);
+        g->nthreads++;
+    }
+    if(g->nthreads == 0) {
+        free(root);
+        return 1;
     }
-    if(i < e->cols)
-        editor_clearline(e, line, i);
+    grep_push(&g->workers[0], root, true);
 
-    if(has_colors())
-        attroff(COLOR_PAIR(EDITOR_PAIR));
+    // Workers that did start steal from the queues of any that did not.
+    for(i = 0; i < g->nthreads; i++) {
+        if(pthread_create(&g->workers[i].thread, NULL, grep_worker,
+                &g->workers[i]) != 0)
+            break;
+        g->nstarted++;
+    }
+    if(g->nstarted == 0) {
+        grep_free(g);
+        return 1;
+    }
+    g->sel = g->skip = 0;
+    g->shown = true;
+    return 0;
 }
-/* Render text buffer from editor.
+/* Check if the search is still running.
  */
-void editor_render(editor_t *e)
+bool grep_busy(grep_t *g)
 {
-    int y;
+    bool busy;
 
-    // Display the text on the screen from the editor buffer.
-    for(y = 0; y < e->rows - 1; y++) {
-        // Render line of text to screen.
-        editor_renderline(e, y);
-    }
+    pthread_mutex_lock(&g->lock);
+    busy = g->pending > 0;
+    pthread_mutex_unlock(&g->lock);
+    return busy;
 }
-/* Set status message for editor.
+/* Get number of results found so far.
  */
-void editor_setstatus(editor_t *e, const char *fmt, ...)
+long grep_count(grep_t *g)
 {
-    va_list ap;
-    va_start(ap, fmt);
-    vsnprintf(e->status, sizeof(e->status), fmt, ap);
-    va_end(ap);
+    long count;
+
+    pthread_mutex_lock(&g->lock);
+    count = g->count;
+    pthread_mutex_unlock(&g->lock);
+    return count;
 }
-/* Render status message on screen.
+/* Describe progress of the search for the status bar.
  */
-void editor_renderstatus(editor_t *e)
+void grep_summary(grep_t *g, char *buf, size_t size)
 {
-    if(has_colors())
-        attron(COLOR_PAIR(STATUS_PAIR));
-    editor_clearline(e, e->rows - 1, 0);
-    mvprintw(e->rows - 1, 0, e->status);
-    if(has_colors())
-        attroff(COLOR_PAIR(STATUS_PAIR));
+    pthread_mutex_lock(&g->lock);
+    snprintf(buf, size, "%ld matches in %ld files%s | Enter: Open "
+        "| Esc: Close", g->count, g->nfiles,
+        g->pending > 0 ? ", searching..." : "");
+    pthread_mutex_unlock(&g->lock);
+}
+/* Handle a key in the results list, returns 1 to open the selected
+ * result, -1 to close the list and 0 otherwise.
+ */
+int grep_key(grep_t *g, int c, int rows)
+{
+    long count;
+
+    pthread_mutex_lock(&g->lock);
+    count = g->count;
+    pthread_mutex_unlock(&g->lock);
+
+    switch(c) {
+        case KEY_UP:
+            g->sel--;
+        break;
+        case KEY_DOWN:
+            g->sel++;
+        break;
+        case KEY_PPAGE:
+            g->sel -= rows - 1;
+        break;
+        case KEY_NPAGE:
+            g->sel += rows - 1;
+        break;
+        case KEY_HOME:
+            g->sel = 0;
+        break;
+        case KEY_END:
+            g->sel = count - 1;
+        break;
+        case KEY_ENTER:
+        case '\n':
+            return count > 0 ? 1 : 0;
+        case '\x1b':
+        case KEY_F(7):
+            return -1;
+    }
+    if(g->sel >= count)
+        g->sel = count - 1;
+    if(g->sel < 0)
+        g->sel = 0;
+    return 0;
+}
+/* Render results list, keeping the selected result on screen.
+ */
+void grep_render(grep_t *g, int rows, int cols)
+{
+    char line[GREP_TEXTLEN + 600];
+    long i;
+    int y;
+
+    if(g->sel < g->skip)
+        g->skip = g->sel;
+    else if(g->sel > g->skip + rows - 2)
+        g->skip = g->sel - (rows - 2);
+
+    pthread_mutex_lock(&g->lock);
+    for(y = 0; y < rows - 1; y++) {
+        int pair = (i = g->skip + y) == g->sel ? STATUS_PAIR : EDITOR_PAIR;
+
+        if(has_colors())
+            attron(COLOR_PAIR(pair));
+        else if(pair == STATUS_PAIR)
+            attron(A_REVERSE);
+        mvhline(y, 0, ' ', cols);
+        if(i < g->count) {
+            snprintf(line, sizeof(line), "%s:%ld: %s", g->results[i].path,
+                g->results[i].line, g->results[i].text);
+            mvaddnstr(y, 0, line, cols);
+        }
+        if(has_colors())
+            attroff(COLOR_PAIR(pair));
+        else
+            attroff(A_REVERSE);
+    }
+    pthread_mutex_unlock(&g->lock);
 }
 
 /* ---------------------------- Main Functions ------------------------- */
@@ -464,39 +3681,124 @@ void editor_renderstatus(editor_t *e)
 #define KEY_TABSTOP 0x09
 #define KEY_BACKSPC 127
 
+static journal_t *hangup_jnl = NULL;
+static struct termios hangup_tty;
+static bool hangup_saved = false;
+static char hangup_reset[128];
+static size_t hangup_len = 0;
+
+/* Commit journal to disk when the terminal goes away, then put the
+ * terminal back the way it was. Only async signal safe calls here, so
+ * the reset sequences are worked out up front.
+ */
+static void journal_hangup(int sig)
+{
+    (void)sig;
+    if(hangup_jnl != NULL)
+        journal_sync(hangup_jnl);
+    if(hangup_len > 0 && write(STDOUT_FILENO, hangup_reset, hangup_len) < 0)
+        hangup_len = 0;
+    if(hangup_saved)
+        tcsetattr(STDIN_FILENO, TCSAFLUSH, &hangup_tty);
+    _exit(1);
+}
+/* Remember how to restore the terminal from the signal handler.
+ */
+static void hangup_init(void)
+{
+    const char *caps[] = { "sgr0", "cnorm", "rmkx", "rmcup" };
+    char *str;
+    size_t i, len;
+
+    for(i = 0; i < sizeof(caps) / sizeof(caps[0]); i++) {
+        str = tigetstr((char *)caps[i]);
+        if(str == NULL || str == (char *)-1)
+            continue;
+        len = strlen(str);
+        if(hangup_len + len > sizeof(hangup_reset))
+            break;
+        memcpy(hangup_reset + hangup_len, str, len);
+        hangup_len += len;
+    }
+}
 /* Initialise ncurses library.
  */
 static void ncurses_init(void)
 {
+    setlocale(LC_ALL, "");
+    hangup_saved = tcgetattr(STDIN_FILENO, &hangup_tty) == 0;
     initscr();
     cbreak();
     noecho();
     raw();
     keypad(stdscr, TRUE);
     atexit((void (*)(void))endwin);
+    hangup_init();
 
     // Initialize colors
     if(has_colors()) {
         start_color();
         init_pair(EDITOR_PAIR, COLOR_RED, COLOR_WHITE);
         init_pair(STATUS_PAIR, COLOR_WHITE, COLOR_RED);
+        init_pair(SYNTAX_PAIR + HL_COMMENT - 1, COLOR_BLUE, COLOR_WHITE);
+        init_pair(SYNTAX_PAIR + HL_KEYWORD - 1, COLOR_MAGENTA, COLOR_WHITE);
+        init_pair(SYNTAX_PAIR + HL_TYPE - 1, COLOR_GREEN, COLOR_WHITE);
+        init_pair(SYNTAX_PAIR + HL_STRING - 1, COLOR_BLACK, COLOR_WHITE);
+        init_pair(SYNTAX_PAIR + HL_NUMBER - 1, COLOR_CYAN, COLOR_WHITE);
+    }
+}
+/* Open selected result of find in files, in its own buffer. Returns 0
+ * when the cursor is on the result.
+ */
+static int editor_openresult(editor_t *e, buffers_t *b, grep_t *g)
+{
+    char path[sizeof(e->filename)];
+    long unsigned col, len;
+    long line;
+
+    pthread_mutex_lock(&g->lock);
+    snprintf(path, sizeof(path), "%s", g->results[g->sel].path);
+    line = g->results[g->sel].line;
+    col = g->results[g->sel].col;
+    pthread_mutex_unlock(&g->lock);
+
+    if(buffer_open(b, e, path) != 0) {
+        editor_setstatus(e, "Error: Could not open %s.", path);
+        e->status_on = true;
+        return 1;
     }
+
+    // Column of the match, the line may have changed since.
+    editor_waitindex(e);
+    editor_gotoline(e, line);
+    len = editor_linelen(e, editor_curline(e));
+    e->skipcols = 0;
+    editor_setcursor(e, col < len ? col : len);
+    e->dirty = true;
+    return 0;
 }
 /* Entry point for text editor.
  */
 int main(int argc, char *argv[])
 {
-    bool istab;
+    struct sigaction sa;
+    long recovered;
+    char *tabstop, *memory;
+    buffers_t bufs;
     editor_t e;
-    int c;
+    grep_t grep;
+    int c, i, rows, cols;
+    bool closing = false;
 
-    // Take a filename as an argument.
-    if(argc != 2) {
-        fprintf(stderr, "Usage: %s <filename>\n", argv[0]);
+    // Take filenames as arguments.
+    if(argc < 2) {
+        fprintf(stderr, "Usage: %s <filename> [filename...]\n", argv[0]);
         return 1;
     }
 
     // Initialise editor.
+    if(editor_restore(argv[1]))
+        fprintf(stderr, "Warning: Restored file from interrupted save.\n");
     e = editor_init();
     if(editor_open(&e, argv[1]) != 0) {
         fprintf(stderr, "Warning: Could not open file, creating...\n");
@@ -505,42 +3807,94 @@ int main(int argc, char *argv[])
             return 1;
         }
     }
-    else {
-        editor_convnewline(&e);
-        editor_convtab(&e, false);
-    }
-    istab = false;
-    editor_getlinecount(&e);
+    snprintf(e.filename, sizeof(e.filename), "%s", argv[1]);
+    if((tabstop = getenv("PSEDIT_TABSTOP")) != NULL && atoi(tabstop) > 0)
+        e.tabstop = atoi(tabstop);
+    e.syntax = syntax_find(argv[1]);
+
+    // Recover unsaved edits and keep journaling from there.
+    recovered = editor_replay(&e, argv[1]);
+    if(journal_open(&e.jnl, argv[1], recovered >= 0) != 0)
+        fprintf(stderr, "Warning: Could not create swap file.\n");
+    hangup_jnl = &e.jnl;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = journal_hangup;
+    sigaction(SIGHUP, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    grep_init(&grep);
+
     ncurses_init();
+    timeout(JOURNAL_IDLEMS);
     getmaxyx(stdscr, e.rows, e.cols);
+
+    // Rest of the files go in to buffers of their own.
+    memory = getenv("PSEDIT_MEMORY");
+    buffer_init(&bufs, memory != NULL ? atol(memory) : 0);
+    for(i = 2; i < argc; i++)
+        buffer_open(&bufs, &e, argv[i]);
+    buffer_switch(&bufs, &e, 0);
+    e.status_on = false;
     clear();
     editor_render(&e);
-    editor_setstatus(&e, "Ctrl-Q: Exit | Ctrl-S: Save | Ctrl-F: Find "
-        "| F3: Find Next | F5: Convert Tabs");
+    editor_setstatus(&e, "^Q: Exit | ^S: Save | ^F: Find | F3: Next "
+        "| F5: Tabs | F6: Wrap | F7: Grep");
+    if(recovered > 0)
+        editor_setstatus(&e, "Recovered %ld edits from %s.swp",
+            recovered, argv[1]);
     editor_renderstatus(&e);
     move(e.cy, e.cx);
 
     while((c = getch()) != CTRL_KEY('q')) {
-        long startx = 0;
-        long endx = 0;
+        long unsigned startx = 0;
+        long unsigned at = 0;
+
+        // Any other key cancels closing a modified buffer.
+        if(c != ERR && c != CTRL_KEY('w'))
+            closing = false;
+
+        // Line index must be complete before touching the buffer.
+        if(editor_waitindex(&e))
+            e.dirty = true;
+
+        // Idle, commit journal to disk.
+        if(c == ERR) {
+            journal_commit(&e.jnl);
+            if(!e.dirty && !grep.shown)
+                continue;
+        }
+
+        // Resizing terminal screen, wrapped lines are laid out again.
+        getmaxyx(stdscr, rows, cols);
+        if(rows != e.rows || cols != e.cols)
+            editor_layout(&e, e.wrap.on, e.tabstop, rows, cols);
 
-        // Resizing terminal screen.
-        getmaxyx(stdscr, e.rows, e.cols);
+        // Handle keyboard input, results list takes it while shown.
+        if(grep.shown) {
+            int key = grep_key(&grep, c, e.rows);
 
-        // Handle keyboard input.
-        switch(c) {
+            if(key < 0 || (key > 0
+                    && editor_openresult(&e, &bufs, &grep) == 0))
+                grep.shown = false;
+            e.dirty = true;
+        }
+        else switch(c) {
             case CTRL_KEY('s'): {
+                long unsigned written;
                 char status[80];
                 int len;
 
-                if(editor_save(&e, argv[1]) != 0) {
+                if(editor_save(&e, e.filename, &written) != 0) {
                     len = snprintf(status, sizeof(status),
-                        "Error: Saving file %s.", argv[1]);
+                        "Error: Saving file %s.", e.filename);
                 }
                 else {
                     len = snprintf(status, sizeof(status),
-                        "Saving file %s totaling %ld bytes.",
-                        argv[1], e.size);
+                        "Saved file %s, wrote %lu of %lu bytes.",
+                        e.filename, written, e.size);
+
+                    // Saved file is the new base for the journal.
+                    journal_close(&e.jnl, e.filename, true);
+                    journal_open(&e.jnl, e.filename, false);
                 }
 
                 // Draw message to status bar.
@@ -556,36 +3910,105 @@ int main(int argc, char *argv[])
                 refresh();
                 e.status_on = true;
             } break;
-            case CTRL_KEY('f'):
-                // Find in file.
-                e.find = 0;
-                e.findstr = editor_findprompt(&e, "Find: ");
-                if(e.findstr != NULL) {
+            case CTRL_KEY('f'): {
+                // Find in file, other prompts reuse the query buffer.
+                char *query = editor_findprompt(&e, "Find: ");
+
+                if(query != NULL) {
+                    e.find = 0;
+                    snprintf(e.findstr, sizeof(e.findstr), "%s", query);
                     editor_find(&e, e.findstr);
                 }
                 e.dirty = true;
+            } break;
+            case CTRL_KEY('g'): {
+                // Go to line in file.
+                char *line = editor_findprompt(&e, "Line: ");
+                if(line != NULL) {
+                    editor_gotoline(&e, atol(line));
+                }
+                e.dirty = true;
+            } break;
+            case KEY_F(7): {
+                // Find in files under current directory, empty query shows
+                // the last results again.
+                char *query = editor_findprompt(&e, "Find in files: ");
+
+                if(query != NULL && query[0] != '\0') {
+                    if(grep_start(&grep, ".", query) != 0) {
+                        editor_setstatus(&e, "Error: Could not start search.");
+                        e.status_on = true;
+                    }
+                }
+                else if(query != NULL)
+                    grep.shown = grep_count(&grep) > 0;
+                e.dirty = true;
+            } break;
+            case CTRL_KEY('o'): {
+                // Open file in a new buffer.
+                char *name = editor_findprompt(&e, "Open: ");
+
+                if(name != NULL && name[0] != '\0'
+                        && buffer_open(&bufs, &e, name) != 0) {
+                    editor_setstatus(&e, "Error: Could not open %s.", name);
+                    e.status_on = true;
+                }
+                e.dirty = true;
+            } break;
+            case CTRL_KEY('n'):
+            case CTRL_KEY('p'): {
+                // Switch to next or previous buffer.
+                int to = bufs.cur + (c == CTRL_KEY('n') ? 1 : -1);
+
+                if(buffer_switch(&bufs, &e, (to + bufs.count) % bufs.count)
+                        != 0) {
+                    editor_setstatus(&e, "Error: Could not load buffer.");
+                    e.status_on = true;
+                }
+                e.dirty = true;
+            } break;
+            case CTRL_KEY('w'):
+                // Close buffer, unsaved changes take a second press.
+                if(e.modified && !closing) {
+                    editor_setstatus(&e, "Unsaved changes, Ctrl-W again "
+                        "to close %s.", e.filename);
+                    e.status_on = true;
+                    closing = true;
+                }
+                else if(buffer_close(&bufs, &e) != 0) {
+                    editor_setstatus(&e, bufs.count == 1
+                        ? "Last buffer, Ctrl-Q to exit."
+                        : "Error: Could not load buffer.");
+                    e.status_on = true;
+                }
+                e.dirty = true;
             break;
             case CTRL_KEY('k'):
                 // Delete current line.
                 if(e.linecount > 0) {
-                    editor_deleteline(&e, e.cy + e.skiprows);
+                    long line = editor_curline(&e);
+
+                    editor_deleteline(&e, line);
                     e.skipcols = 0;
-                    e.cx = 0;
+                    editor_moveto(&e, line, 0);
                     e.dirty = true;
                 }
             break;
             case KEY_F(3):
                 // Find next in file.
-                if(e.findstr != NULL) {
+                if(e.findstr[0] != '\0') {
                     editor_find(&e, e.findstr);
                 }
                 e.dirty = true;
             break;
             case KEY_F(5):
-                // Convert tabs to spaces and back again.
-                istab = !istab;
-                editor_convtab(&e, istab);
-                e.dirty = true;
+                // Cycle tab width, tabs are only expanded on screen.
+                editor_layout(&e, e.wrap.on, e.tabstop < 8 ? e.tabstop * 2 : 2,
+                    e.rows, e.cols);
+            break;
+            case KEY_F(6):
+                // Toggle soft wrapping of long lines.
+                editor_layout(&e, !e.wrap.on, e.tabstop, e.rows, e.cols);
             break;
             case KEY_UP:
                 if(e.cy != 0) {
@@ -599,31 +4022,19 @@ int main(int argc, char *argv[])
                     e.dirty = true;
                 }
 
-                // Get start and end of current line.
-                startx = editor_getoffset(&e, e.cy + e.skiprows);
-                endx = editor_getoffset(&e, (e.cy + e.skiprows) + 1);
-
                 // Reset cursor position to snap to end of line.
-                if((e.cx + e.skipcols) > (endx - startx) - 1) {
-                    int len = (endx - startx) - 1;
-                    int skipcols = len - e.cols + 1;
-                    int skipcx = (len - skipcols) % e.cols;
-
-                    // Calculate how many columns to skip.
-                    e.skipcols = (len >= e.cols ? skipcols: 0);
-                    // Calculate how many columns left from length.
-                    e.cx = len >= e.cols ? skipcx : len > 0 ? len : 0;
-                    e.dirty = true;
-                }
+                editor_snapcursor(&e);
             break;
-            case KEY_DOWN:
+            case KEY_DOWN: {
+                long rowcount = editor_rowcount(&e);
+
                 if(e.cy != (e.rows - 2) &&
-                    (e.cy + e.skiprows) < (e.linecount - 1)) {
+                    (e.cy + e.skiprows) < (rowcount - 1)) {
                     e.cy++;
                 }
                 else if(e.cy >= (e.rows - 2) &&
-                    (e.cy + e.skiprows) < (e.linecount - 1)) {
-                    int skiptotal = e.linecount - (e.rows - 2);
+                    (e.cy + e.skiprows) < (rowcount - 1)) {
+                    long skiptotal = rowcount - (e.rows - 2);
                     if(e.skiprows < skiptotal)
                         e.skiprows++;
                     else
@@ -631,51 +4042,20 @@ int main(int argc, char *argv[])
                     e.dirty = true;
                 }
 
-                // Get start and end of current line.
-                startx = editor_getoffset(&e, e.cy + e.skiprows);
-                endx = editor_getoffset(&e, (e.cy + e.skiprows) + 1);
-
                 // Reset cursor position to snap to end of line.
-                if((e.cx + e.skipcols) > (endx - startx) - 1) {
-                    int len = (endx - startx) - 1;
-                    int skipcols = len - e.cols + 1;
-                    int skipcx = (len - skipcols) % e.cols;
-
-                    // Calculate how many columns to skip.
-                    e.skipcols = (len >= e.cols ? skipcols: 0);
-                    // Calculate how many columns left from length.
-                    e.cx = len >= e.cols ? skipcx : len > 0 ? len : 0;
-                    e.dirty = true;
-                }
-            break;
+                editor_snapcursor(&e);
+            } break;
             case KEY_LEFT:
-                if(e.cx != 0) {
-                    e.cx--;
-                }
-                else {
-                    if(e.skipcols > 0)
-                        e.skipcols--;
-                    else
-                        e.skipcols = 0;
-                    e.dirty = true;
-                }
+                at = editor_cursor(&e);
+                if(at > 0)
+                    editor_setcursor(&e,
+                        editor_prevchar(&e, editor_curline(&e), at));
             break;
             case KEY_RIGHT:
-                startx = editor_getoffset(&e, e.cy + e.skiprows);
-                endx = editor_getoffset(&e, (e.cy + e.skiprows) + 1);
-                if(e.cx < (e.cols - 1) && e.cx < (endx - startx) - 1) {
-                    e.cx++;
-                }
-                else if(e.cx >= (e.cols - 1) &&
-                    (e.cx + e.skipcols) < (endx - startx) - 1) {
-                    int len = endx - startx;
-                    int skiptotal = len >= e.cols ? len - e.cols + 1 : 0;
-                    if(e.skipcols < skiptotal)
-                        e.skipcols++;
-                    else
-                        e.skipcols = skiptotal;
-                    e.dirty = true;
-                }
+                at = editor_cursor(&e);
+                if(at < editor_linelen(&e, editor_curline(&e)))
+                    editor_setcursor(&e,
+                        editor_nextchar(&e, editor_curline(&e), at));
             break;
             case KEY_PPAGE:
                 if(e.skiprows > MAXSKIPROW)
@@ -683,186 +4063,121 @@ int main(int argc, char *argv[])
                 else
                     e.skiprows = 0;
 
-                startx = editor_getoffset(&e, e.cy + e.skiprows);
-                endx = editor_getoffset(&e, (e.cy + e.skiprows) + 1);
-
                 // Snap cursor to end of line.
-                if((e.cx + e.skipcols) > (endx - startx) - 1) {
-                    int len = (endx - startx) - 1;
-                    int skipcols = len - e.cols + 1;
-                    int skipcx = (len - skipcols) % e.cols;
-
-                    e.skipcols = len >= e.cols ? skipcols : 0;
-                    e.cx = len >= e.cols ? skipcx : len > 0 ? len : 0;
-                }
+                editor_snapcursor(&e);
                 e.dirty = true;
             break;
-            case KEY_NPAGE:
-                if(e.linecount > (e.rows - 1)) {
-                    if(e.skiprows < (e.linecount - e.rows + 1) - MAXSKIPROW)
+            case KEY_NPAGE: {
+                long rowcount = editor_rowcount(&e);
+
+                if(rowcount > (e.rows - 1)) {
+                    if(e.skiprows < (rowcount - e.rows + 1) - MAXSKIPROW)
                         e.skiprows += MAXSKIPROW;
                     else
-                        e.skiprows = e.linecount - e.rows + 1;
+                        e.skiprows = rowcount - e.rows + 1;
                 }
 
-                startx = editor_getoffset(&e, e.cy + e.skiprows);
-                endx = editor_getoffset(&e, (e.cy + e.skiprows) + 1);
-
                 // Snap cursor to end of line.
-                if((e.cx + e.skipcols) > (endx - startx) - 1) {
-                    int len = (endx - startx) - 1;
-                    int skipcols = len - e.cols + 1;
-                    int skipcx = (len - skipcols) % e.cols;
-
-                    e.skipcols = len >= e.cols ? skipcols : 0;
-                    e.cx = len >= e.cols ? skipcx : len > 0 ? len : 0;
-                }
+                editor_snapcursor(&e);
                 e.dirty = true;
-            break;
+            } break;
             case KEY_HOME:
-                if((e.cx + e.skipcols) != 0) {
-                    e.cx = 0;
-                    e.skipcols = 0;
-                    e.dirty = true;
-                }
+                editor_setcursor(&e, 0);
             break;
             case KEY_END:
-                startx = editor_getoffset(&e, e.cy + e.skiprows);
-                endx = editor_getoffset(&e, (e.cy + e.skiprows) + 1);
-                if(e.cx <= (e.cols - 1) &&
-                    (e.cx + e.skipcols) < (endx - startx)) {
-                    int len = (endx - startx) - 1;
-                    int skipcols = len - e.cols + 1;
-                    int skipcx = (len - skipcols) % e.cols;
-
-                    // Calculate how many columns to skip.
-                    e.skipcols = (len >= e.cols ? skipcols: 0);
-                    // Calculate how many columns left from length.
-                    e.cx = len >= e.cols ? skipcx : len > 0 ? len : 0;
-                    e.dirty = true;
-                }
+                editor_setcursor(&e, editor_linelen(&e, editor_curline(&e)));
             break;
-            case KEY_DC:
-                startx = editor_getoffset(&e, e.cy + e.skiprows);
-                endx = editor_getoffset(&e, (e.cy + e.skiprows) + 1);
-                if((e.cx + e.skipcols) >= 0 &&
-                    (e.cx + e.skipcols) < (endx - startx) &&
-                    (e.cy + e.skiprows) < e.linecount) {
-                    editor_delchr(&e, startx + (e.cx + e.skipcols));
+            case KEY_DC: {
+                long line = editor_curline(&e);
+
+                startx = editor_getoffset(&e, line);
+                at = editor_cursor(&e);
+                if(line < e.linecount) {
+                    // Whole character, or the new line at the end.
+                    long unsigned next = editor_nextchar(&e, line, at);
+                    editor_delchars(&e, startx + at, next > at ? next - at : 1);
                 }
                 e.dirty = true;
-            break;
+            } break;
             case KEY_BACKSPACE:
-            case KEY_BACKSPC:
-                startx = editor_getoffset(&e, e.cy + e.skiprows);
-                endx = editor_getoffset(&e, (e.cy + e.skiprows) + 1);
-                if((e.cx + e.skipcols) > 0 &&
-                    (e.cx + e.skipcols) <= (endx - startx) &&
-                    (e.cy + e.skiprows) < e.linecount) {
-                    if(e.cx > 0)
-                        e.cx--;
-                    else
-                        e.skipcols--;
-                    editor_delchr(&e, startx + (e.cx + e.skipcols));
-                }
-                else if((e.cx + e.skipcols) == 0 && (e.cy + e.skiprows) > 0 &&
-                    (e.cy + e.skiprows) < e.linecount) {
-                    int len;
-
-                    startx = editor_getoffset(&e, (e.cy - 1) + e.skiprows);
-                    endx = editor_getoffset(&e, e.cy + e.skiprows);
-                    len = (endx - startx);
-                    if(len >= (e.cols - 1)) {
-                        int skipcols = len - e.cols + 1;
-                        int skipcx = (len - skipcols) % e.cols;
-
-                        // Calculate how many columns to skip.
-                        e.skipcols = (len >= e.cols ? skipcols: 0);
-                        // Calculate how many columns left from length.
-                        e.cx = len >= e.cols ? skipcx : len > 0 ? len : 0;
-                    } else {
-                        e.skipcols = 0;
-                        e.cx = len > 0 ? len - 1 : 0;
-                    }
-                    if(e.cy > 0)
-                        e.cy--;
-                    else
-                        e.skiprows--;
-                    editor_delchr(&e, startx + (e.cx + e.skipcols));
-                }
-                else if((e.cx + e.skipcols) == 0 && (e.cy + e.skiprows) == 0 &&
-                    (e.cy + e.skiprows) < e.linecount) {
-                    if(e.skiprows > 0) {
-                        int len;
+            case KEY_BACKSPC: {
+                long line = editor_curline(&e);
 
-                        e.skiprows--;
-                        startx = editor_getoffset(&e, e.cy + e.skiprows);
-                        endx = editor_getoffset(&e, (e.cy + e.skiprows) + 1);
-                        len = (endx - startx);
-                        if(len >= (e.cols - 1)) {
-                            int skipcols = len - e.cols + 1;
-                            int skipcx = (len - skipcols) % e.cols;
-
-                            // Calculate how many columns to skip.
-                            e.skipcols = (len >= e.cols ? skipcols: 0);
-                            // Calculate how many columns left from length.
-                            e.cx = len >= e.cols ? skipcx : len > 0 ? len : 0;
-                        } else {
-                            e.skipcols = 0;
-                            e.cx = len > 0 ? len - 1 : 0;
-                        }
-                        editor_delchr(&e, startx + (e.cx + e.skipcols));
-                    }
-                    else {
-                        e.skiprows = 0;
-                    }
+                startx = editor_getoffset(&e, line);
+                at = editor_cursor(&e);
+                if(at > 0 && line < e.linecount) {
+                    long unsigned prev = editor_prevchar(&e, line, at);
+
+                    editor_delchars(&e, startx + prev, at - prev);
+                    editor_setcursor(&e, prev);
                 }
-                e.dirty = true;
-            break;
-            case KEY_TABSTOP: {
-                int tabstop = MAXTABSTOP;
-                startx = editor_getoffset(&e, e.cy + e.skiprows);
-                while(tabstop-- > 0) {
-                    editor_inschr(&e, startx + (e.cx + e.skipcols), ' ');
-                    if(e.cx < (e.cols - 1))
-                        e.cx++;
-                    else
-                        e.skipcols++;
+                else if(at == 0 && line > 0 && line < e.linecount) {
+                    // Join with end of previous line.
+                    at = editor_linelen(&e, line - 1);
+                    e.skipcols = 0;
+                    editor_moveto(&e, line - 1, at);
+                    editor_delchr(&e, editor_getoffset(&e, line - 1) + at);
                 }
                 e.dirty = true;
             } break;
+            case KEY_TABSTOP:
+                // Tabs stay tabs, they are expanded on screen.
+                startx = editor_getoffset(&e, editor_curline(&e));
+                at = editor_cursor(&e);
+                editor_inschr(&e, startx + at, '\t');
+                editor_setcursor(&e, at + 1);
+                e.dirty = true;
+            break;
             case KEY_ENTER:
-            case KEY_RETURN:
-                startx = editor_getoffset(&e, e.cy + e.skiprows);
-                editor_inschr(&e, startx + (e.cx + e.skipcols), '\n');
-                if(e.cy != (e.rows - 2))
-                    e.cy++;
-                else {
-                    int skiptotal = e.linecount - (e.rows - 1);
-                    if(e.skiprows < skiptotal)
-                        e.skiprows++;
-                    else
-                        e.skiprows = skiptotal;
-                }
-                e.cx = 0;
+            case KEY_RETURN: {
+                long line = editor_curline(&e);
+
+                startx = editor_getoffset(&e, line);
+                editor_inschr(&e, startx + editor_cursor(&e), '\n');
                 e.skipcols = 0;
+                editor_moveto(&e, line + 1, 0);
                 e.dirty = true;
-            break;
+            } break;
             default:
-                if(isprint(c)) {
+                if(isprint(c) || (c >= 0xC2 && c <= 0xF4)) {
+                    int i, n = c < 0x80 ? 1 : c < 0xE0 ? 2 : c < 0xF0 ? 3 : 4;
+                    char buf[4];
+
+                    // Rest of a UTF-8 sequence follows straight away.
+                    buf[0] = c;
+                    for(i = 1; i < n && (c = getch()) >= 0x80 && c < 0xC0; i++)
+                        buf[i] = c;
+                    if(i < n) {
+                        if(c != ERR)
+                            ungetch(c);
+                        break;
+                    }
                     if(e.cx < e.cols && e.cy < (e.rows - 1)) {
-                        startx = editor_getoffset(&e, e.cy + e.skiprows);
-                        editor_inschr(&e, startx + (e.cx + e.skipcols), c);
-                        if(e.cx < (e.cols - 1))
-                            e.cx++;
-                        else
-                            e.skipcols++;
+                        startx = editor_getoffset(&e, editor_curline(&e));
+                        at = editor_cursor(&e);
+                        for(i = 0; i < n; i++)
+                            editor_inschr(&e, startx + at + i, buf[i]);
+                        editor_setcursor(&e, at + n);
                         e.dirty = true;
                     }
                 }
             break;
         }
 
+        // Results list covers the text while shown.
+        if(grep.shown) {
+            grep_render(&grep, e.rows, e.cols);
+            if(!e.status_on)
+                grep_summary(&grep, e.status, sizeof(e.status));
+            editor_renderstatus(&e);
+            e.status_on = false;
+            e.dirty = false;
+            move(grep.sel - grep.skip, 0);
+            timeout(grep_busy(&grep) ? GREP_REFRESHMS : JOURNAL_IDLEMS);
+            continue;
+        }
+        timeout(JOURNAL_IDLEMS);
+
         // Clear screen and repaint text.
         if(e.dirty) {
             editor_render(&e);
@@ -870,13 +4185,13 @@ int main(int argc, char *argv[])
             e.dirty = false;
         }
 
-        // Render status message.
+        // Render status message, a message is shown until the next key.
         if(!e.status_on) {
-            editor_setstatus(&e, "[%s] - Lines: %ld/%ld",
-                argv[1], e.linecount != 0 ? (e.cy + e.skiprows) + 1 : 0,
-                e.linecount);
-            editor_renderstatus(&e);
+            editor_setstatus(&e, "(%d/%d) [%s] - Lines: %ld/%ld",
+                bufs.cur + 1, bufs.count, e.filename,
+                e.linecount != 0 ? editor_curline(&e) + 1 : 0, e.linecount);
         }
+        editor_renderstatus(&e);
 
         // Reset status message.
         if(e.status_on)
@@ -886,6 +4201,8 @@ int main(int argc, char *argv[])
         move(e.cy, e.cx);
     }
 
-    editor_free(&e);
+    grep_free(&grep);
+    hangup_jnl = NULL;
+    buffer_free(&bufs, &e);
     return 0;
 }